@@ -0,0 +1,49 @@
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+void countBytes(size_t oldSize, size_t newSize);
+
+/**
+ * A std allocator for containers inside heap objects, like a function's
+ * Chunk, so what they allocate counts toward VM::bytesAllocated the same as
+ * anything that goes through reallocate(). Unlike reallocate() it never
+ * collects, since the container may be halfway through changing.
+ */
+template <typename T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t count) {
+    countBytes(0, sizeof(T) * count);
+    return std::allocator<T>().allocate(count);
+  }
+
+  void deallocate(T* pointer, size_t count) {
+    countBytes(sizeof(T) * count, 0);
+    std::allocator<T>().deallocate(pointer, count);
+  }
+
+  template <typename U>
+  bool operator==(const CountingAllocator<U>&) const { return true; }
+  template <typename U>
+  bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using CountedVector = std::vector<T, CountingAllocator<T>>;
+
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename Equal = std::equal_to<K>>
+using CountedMap = std::unordered_map<K, V, Hash, Equal,
+                                      CountingAllocator<std::pair<const K, V>>>;
+
+#endif
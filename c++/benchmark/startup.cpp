@@ -0,0 +1,65 @@
+// Times starting ./main on large scripts from source against from their .loxc.
+// Built and run by `make startbench`, after `make release`.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+// Lots of functions and classes to compile, but next to nothing to run.
+static void writeScript(const std::string& path, int count) {
+  std::ofstream out(path);
+  for (int i = 0; i < count; i++) {
+    out << "fun f" << i << "(a, b) {\n"
+        << "  var c = a * " << i << " + b;\n"
+        << "  if (c > 100) return \"big " << i << "\";\n"
+        << "  for (var j = 0; j < b; j = j + 1) c = c + j;\n"
+        << "  return c;\n"
+        << "}\n"
+        << "class C" << i << " {\n"
+        << "  init(x) { this.x = x; }\n"
+        << "  get() { return this.x + " << i << "; }\n"
+        << "}\n";
+  }
+  out << "print f0(1, 2);\n";
+}
+
+// Returns the best of runs wall clock times, in milliseconds.
+static double timeRuns(const std::string& command, int runs) {
+  double best = 1e9;
+  for (int i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    if (std::system(command.c_str()) != 0) return -1;
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    if (ms < best) best = ms;
+  }
+  return best;
+}
+
+int main() {
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "loxstartup";
+  std::filesystem::create_directories(dir);
+  std::string script = (dir / "startup.lox").string();
+  std::string cached = (dir / "startup.loxc").string();
+  std::string run = "./main " + script + " > /dev/null";
+
+  printf("%10s %10s %10s %8s\n", "bytes", "source ms", "loxc ms", "speedup");
+  // Up to about 2 MB, which is as big as the script's constant table goes
+  for (int count : {10, 500, 10000}) {
+    writeScript(script, count);
+    std::filesystem::remove(cached);
+
+    double source = timeRuns(run, 10);
+    if (source < 0 || std::system(("./main --emit-loxc " + script).c_str()) != 0) {
+      fprintf(stderr, "Could not run ./main, build it with `make release` first.\n");
+      return 1;
+    }
+    double loxc = timeRuns(run, 10);
+    printf("%10ju %10.2f %10.2f %7.1fx\n",
+           (uintmax_t)std::filesystem::file_size(script), source, loxc, source / loxc);
+  }
+  std::filesystem::remove_all(dir);
+  return 0;
+}
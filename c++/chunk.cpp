@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "object.h"
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include "vm.h"
@@ -9,12 +10,174 @@
 void Chunk::writeChunk(uint8_t byte, int line)
 {
   code.push_back(byte);
-  lines.push_back(line);
+  if (lines.empty() || lines.back().line != line) {
+    lines.push_back({(int)code.size() - 1, line});
+  }
 }
 
+/**
+ * The line the byte at offset was compiled from. Binary searches for the last
+ * run starting at or before it. Only errors and the disassembler need this,
+ * so it doesn't have to be fast.
+ */
+int Chunk::getLine(int offset)
+{
+  auto run = std::upper_bound(lines.begin(), lines.end(), offset,
+                              [](int offset, const LineStart& start) {
+                                return offset < start.offset;
+                              });
+  return run == lines.begin() ? 0 : (run - 1)->line;
+}
+
+CountedVector<LineStart>& Chunk::getLineStarts()
+{
+  return lines;
+}
+
+// Gives back everything the chunk allocated, once its function is dead
 void Chunk::freeChunk()
 {
-  code.clear();
+  CountedVector<uint8_t>().swap(code);
+  CountedVector<Value>().swap(constants);
+  CountedVector<InlineCache>().swap(caches);
+  CountedVector<LineStart>().swap(lines);
+  freeConstantIndex();
+}
+
+/**
+ * Makes an empty inline cache for an instruction that was just written and
+ * returns its index, which the compiler writes as the instruction's last
+ * operand.
+ */
+int Chunk::addCache(uint8_t instruction)
+{
+  InlineCache cache = {};
+  cache.instruction = instruction;
+  cache.line = lines.back().line;
+  caches.push_back(cache);
+  return caches.size() - 1;
+}
+
+/**
+ * Throws away everything written after the given counts, for the compiler to
+ * drop code it found out is unreachable.
+ */
+void Chunk::truncate(int codeCount, int constantCount, int cacheCount)
+{
+  code.resize(codeCount);
+  while (!lines.empty() && lines.back().offset >= codeCount) lines.pop_back();
+  for (size_t i = constantCount; i < constants.size(); i++) {
+    constantIndex.erase(constants[i]);
+  }
+  constants.resize(constantCount);
+  constantUses.resize(constantCount);
+  caches.resize(cacheCount);
+}
+
+static const char* opcodeNames[] = {
+  "OP_CONSTANT",
+  "OP_NIL",
+  "OP_TRUE",
+  "OP_FALSE",
+  "OP_POP",
+  "OP_GET_LOCAL",
+  "OP_SET_LOCAL",
+  "OP_DEFINE_GLOBAL",
+  "OP_GET_GLOBAL",
+  "OP_SET_GLOBAL",
+  "OP_GET_UPVALUE",
+  "OP_SET_UPVALUE",
+  "OP_EQUAL",
+  "OP_SET_PROPERTY",
+  "OP_GET_PROPERTY",
+  "OP_GET_SUPER",
+  "OP_GREATER",
+  "OP_LESS",
+  "OP_ADD",
+  "OP_SUBTRACT",
+  "OP_MULTIPLY",
+  "OP_DIVIDE",
+  "OP_NOT",
+  "OP_NEGATE",
+  "OP_PRINT",
+  "OP_JUMP",
+  "OP_JUMP_IF_FALSE",
+  "OP_LOOP",
+  "OP_CALL",
+  "OP_INVOKE",
+  "OP_SUPER_INVOKE",
+  "OP_CLOSURE",
+  "OP_CLOSE_UPVALUE",
+  "OP_RETURN",
+  "OP_CLASS",
+  "OP_INHERIT",
+  "OP_METHOD",
+  "OP_CONSTANT_LONG",
+  "OP_GET_GLOBAL_LONG",
+  "OP_GET_PROPERTY_LONG",
+  "OP_WIDE",
+  "OP_ADD_LOCAL_LOCAL",
+  "OP_LESS_LOCAL_CONST_JUMP",
+  "OP_INCREMENT_LOCAL",
+};
+static_assert(sizeof(opcodeNames) / sizeof(opcodeNames[0]) == OPCODE_COUNT,
+              "opcodeNames must have one entry per OpCode, in order");
+
+const char* opcodeName(uint8_t instruction)
+{
+  return instruction < OPCODE_COUNT ? opcodeNames[instruction] : "unknown";
+}
+
+static const char* registerOpcodeNames[] = {
+  "ROP_LOAD_CONSTANT",
+  "ROP_LOAD_NIL",
+  "ROP_LOAD_TRUE",
+  "ROP_LOAD_FALSE",
+  "ROP_MOVE",
+  "ROP_GET_GLOBAL",
+  "ROP_DEFINE_GLOBAL",
+  "ROP_SET_GLOBAL",
+  "ROP_EQUAL",
+  "ROP_GREATER",
+  "ROP_LESS",
+  "ROP_ADD",
+  "ROP_SUBTRACT",
+  "ROP_MULTIPLY",
+  "ROP_DIVIDE",
+  "ROP_NOT",
+  "ROP_NEGATE",
+  "ROP_PRINT",
+  "ROP_JUMP",
+  "ROP_JUMP_IF_FALSE",
+  "ROP_LOOP",
+  "ROP_GREATER_JUMP",
+  "ROP_LESS_JUMP",
+  "ROP_CALL",
+  "ROP_CLOSURE",
+  "ROP_RETURN",
+};
+static_assert(sizeof(registerOpcodeNames) / sizeof(registerOpcodeNames[0]) == REGISTER_OPCODE_COUNT,
+              "registerOpcodeNames must have one entry per RegisterOpCode, in order");
+
+const char* registerOpcodeName(uint8_t instruction)
+{
+  return instruction < REGISTER_OPCODE_COUNT ? registerOpcodeNames[instruction] : "unknown";
+}
+
+/**
+ * Prints hits and misses for every inline cache in the chunk that got used.
+ * The VM only counts them when built with -DINLINE_CACHE_STATS.
+ */
+void Chunk::printCacheStats(const char* name)
+{
+  for (InlineCache& cache : caches) {
+    uint32_t total = cache.hits + cache.misses;
+    if (total == 0) continue;
+
+    fmt::printf("%-16s [line %d] %-16s %10u hits %8u misses %5.1f%% (%d shapes)\n",
+                name, cache.line, opcodeName(cache.instruction), cache.hits, cache.misses,
+                100.0 * cache.hits / total, cache.count);
+  }
 }
 
 // DEBUG: Printing instructions
@@ -55,8 +218,17 @@ bool valuesEqual(Value a, Value b)
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b) return true;
+  if (IS_STRING(a) && IS_STRING(b)) {
+    return stringsEqual(AS_STRING(a), AS_STRING(b));
+  }
+  if (IS_ROPE(a) || IS_ROPE(b)) {
+    return textEqual(a, b);
+  }
+  return false;
 #else
+  if (IS_ROPE(a) || IS_ROPE(b))
+    return textEqual(a, b);
   if (a.type != b.type)
     return false;
   switch (a.type)
@@ -68,6 +240,8 @@ bool valuesEqual(Value a, Value b)
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
+    if (IS_STRING(a) && IS_STRING(b))
+      return stringsEqual(AS_STRING(a), AS_STRING(b));
     return AS_OBJ(a) == AS_OBJ(b);
   default:
     return false;
@@ -86,11 +260,21 @@ int Chunk::count()
   return code.size();
 }
 
-int Chunk::byteInstruction(const std::string &name, int offset)
+/**
+ * The helpers below take the offset of the instruction's opcode and, when wide
+ * is set, read its first operand as 2 bytes. That covers both the _LONG
+ * opcodes and whatever follows an OP_WIDE prefix.
+ */
+int Chunk::operandAt(int offset, bool wide)
+{
+  return wide ? (code[offset] << 8) | code[offset + 1] : code[offset];
+}
+
+int Chunk::byteInstruction(const std::string &name, int offset, bool wide)
 {
-  uint8_t slot = code[offset + 1];
+  int slot = operandAt(offset + 1, wide);
   fmt::printf("%-16s %4d\n", name.c_str(), slot);
-  return offset + 2;
+  return offset + 2 + wide;
 }
 
 int Chunk::jumpInstruction(const std::string &name, int sign, int offset)
@@ -101,35 +285,124 @@ int Chunk::jumpInstruction(const std::string &name, int sign, int offset)
   return offset + 3;
 }
 
-int Chunk::constantInstruction(const std::string &name, int offset)
+int Chunk::constantInstruction(const std::string &name, int offset, bool wide)
 {
-  uint8_t constantIndex = code[offset + 1];
+  int constantIndex = operandAt(offset + 1, wide);
   fmt::printf("%-16s %4d '", name.c_str(), constantIndex);
   printValue(constants[constantIndex]);
   std::cout << "'\n";
+  return offset + 2 + wide;
+}
+
+// OP_SUPER_INVOKE has the same operands as OP_INVOKE minus the cache
+int Chunk::invokeInstruction(const std::string& name, int offset, bool wide) {
+  bool cached = code[offset] == OP_INVOKE;
+  int constant = operandAt(offset + 1, wide);
+  offset += 2 + wide;
+  uint8_t argCount = code[offset++];
+  printf("%-16s (%d args) %4d '", name.c_str(), argCount, constant);
+  printValue(constants[constant]);
+  if (!cached) {
+    printf("'\n");
+    return offset;
+  }
+  uint16_t cache = (uint16_t)((code[offset] << 8) | code[offset + 1]);
+  printf("' cache %d\n", cache);
   return offset + 2;
 }
 
+int Chunk::closureInstruction(const std::string& name, int offset, bool wide) {
+  int constant = operandAt(offset + 1, wide);
+  offset += 2 + wide;
+  printf("%-16s %4d ", name.c_str(), constant);
+  printValue(constants[constant]);
+  printf("\n");
 
-int Chunk::invokeInstruction(const std::string& name, int offset) {
-  uint8_t constant = code[offset + 1];
-  uint8_t argCount = code[offset + 2];
-  printf("%-16s (%d args) %4d '", name.c_str(), argCount, constant);
+  ObjFunction *function = AS_FUNCTION(constants[constant]);
+  for (int j = 0; j < function->upvalueCount; j++)
+  {
+    int isLocal = code[offset];
+    int index = operandAt(offset + 1, wide);
+    printf("%04d      |                     %s %d\n", offset, isLocal ? "local" : "upvalue", index);
+    offset += 2 + wide;
+  }
+
+  return offset;
+}
+
+// An OP_WIDE prefix is shown together with the instruction it widens, named
+// like the dedicated _LONG opcodes
+int Chunk::wideInstruction(int offset) {
+  uint8_t instruction = code[offset + 1];
+  std::string name = std::string(opcodeName(instruction)) + "_LONG";
+  offset++;
+  switch (instruction)
+  {
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    return byteInstruction(name, offset, true);
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_SUPER:
+  case OP_CLASS:
+  case OP_METHOD:
+    return constantInstruction(name, offset, true);
+  case OP_SET_PROPERTY:
+    return cachedInstruction(name, offset, true);
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    return invokeInstruction(name, offset, true);
+  case OP_CLOSURE:
+    return closureInstruction(name, offset, true);
+  default:
+    std::cout << fmt::format("OP_WIDE before unknown opcode {}\n", instruction);
+    return offset + 1;
+  }
+}
+
+/**
+ * Superinstructions show the local slots they read (the operands of the first
+ * and, for OP_ADD_LOCAL_LOCAL, second instruction of the run) and then skip
+ * the rest of the run, same as the VM does.
+ */
+int Chunk::fusedInstruction(const std::string& name, int offset, int length) {
+  if (code[offset] == OP_ADD_LOCAL_LOCAL) {
+    printf("%-16s %4d %4d\n", name.c_str(), code[offset + 1], code[offset + 3]);
+  } else {
+    uint8_t constant = code[offset + 3];
+    printf("%-16s %4d '", name.c_str(), code[offset + 1]);
+    printValue(constants[constant]);
+    if (code[offset] == OP_LESS_LOCAL_CONST_JUMP) {
+      int jump = (code[offset + 6] << 8) | code[offset + 7];
+      printf("' -> %d\n", offset + 8 + jump);
+    } else {
+      printf("'\n");
+    }
+  }
+  return offset + length;
+}
+
+int Chunk::cachedInstruction(const std::string& name, int offset, bool wide) {
+  int constant = operandAt(offset + 1, wide);
+  offset += 2 + wide;
+  uint16_t cache = (uint16_t)((code[offset] << 8) | code[offset + 1]);
+  printf("%-16s %4d '", name.c_str(), constant);
   printValue(constants[constant]);
-  printf("'\n");
-  return offset+3;
+  printf("' cache %d\n", cache);
+  return offset + 2;
 }
 
 int Chunk::disassembleInstruction(int offset)
 {
   std::cout << std::setfill('0') << std::setw(4) << offset << " ";
-  if (offset > 0 && lines[offset] == lines[offset - 1])
+  int line = getLine(offset);
+  if (offset > 0 && line == getLine(offset - 1))
   {
     std::cout << "   | ";
   }
   else
   {
-    fmt::printf("%4d ", lines[offset]);
+    fmt::printf("%4d ", line);
   }
 
   uint8_t instruction = code[offset];
@@ -160,9 +433,9 @@ int Chunk::disassembleInstruction(int offset)
   case OP_SET_UPVALUE:
     return constantInstruction("OP_SET_UPVALUE", offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", offset);
+    return cachedInstruction("OP_GET_PROPERTY", offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", offset);
+    return cachedInstruction("OP_SET_PROPERTY", offset);
   case OP_GET_SUPER:
     return constantInstruction("OP_GET_SUPER", offset);
   case OP_EQUAL:
@@ -198,23 +471,7 @@ int Chunk::disassembleInstruction(int offset)
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", offset);
   case OP_CLOSURE:
-  {
-    offset++;
-    uint8_t constant = code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
-    printValue(constants[constant]);
-    printf("\n");
-
-    ObjFunction *function = AS_FUNCTION(constants[constant]);
-    for (int j = 0; j < function->upvalueCount; j++)
-    {
-      int isLocal = code[offset++];
-      int index = code[offset++];
-      printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-    }
-
-    return offset;
-  }
+    return closureInstruction("OP_CLOSURE", offset);
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
@@ -225,6 +482,20 @@ int Chunk::disassembleInstruction(int offset)
     return simpleInstruction("OP_INHERIT", offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", offset);
+  case OP_CONSTANT_LONG:
+    return constantInstruction("OP_CONSTANT_LONG", offset, true);
+  case OP_GET_GLOBAL_LONG:
+    return constantInstruction("OP_GET_GLOBAL_LONG", offset, true);
+  case OP_GET_PROPERTY_LONG:
+    return cachedInstruction("OP_GET_PROPERTY_LONG", offset, true);
+  case OP_WIDE:
+    return wideInstruction(offset);
+  case OP_ADD_LOCAL_LOCAL:
+    return fusedInstruction("OP_ADD_LOCAL_LOCAL", offset, 5);
+  case OP_LESS_LOCAL_CONST_JUMP:
+    return fusedInstruction("OP_LESS_LOCAL_CONST_JUMP", offset, 9);
+  case OP_INCREMENT_LOCAL:
+    return fusedInstruction("OP_INCREMENT_LOCAL", offset, 8);
   default:
     std::cout << fmt::format("Unknown opcode {}\n", instruction);
     return offset + 1;
@@ -240,20 +511,164 @@ void Chunk::disassembleChunk(const std::string &name)
   }
 }
 
+void Chunk::disassembleRegisterChunk(const std::string &name)
+{
+  fmt::printf("== %s (registers) ==\n", name);
+  for (size_t offset = 0; offset < code.size();)
+  {
+    offset = disassembleRegisterInstruction(offset);
+  }
+}
+
 /**
- * @brief Adds a value to the constant pool
- * @return The index of the added value
+ * Registers print as r<n> and constant operands as their value, so
+ * `ROP_ADD r3 = r1, '1'` is r3 = r1 + 1.
+ */
+int Chunk::disassembleRegisterInstruction(int offset)
+{
+  std::cout << std::setfill('0') << std::setw(4) << offset << " ";
+  int line = getLine(offset);
+  if (offset > 0 && line == getLine(offset - 1))
+  {
+    std::cout << "   | ";
+  }
+  else
+  {
+    fmt::printf("%4d ", line);
+  }
+
+  auto operand = [&](uint8_t index, bool isConstant) {
+    if (isConstant) {
+      printf("'");
+      printValue(constants[index]);
+      printf("'");
+    } else {
+      printf("r%d", index);
+    }
+  };
+  auto jumpTarget = [&](int end, int sign) {
+    return end + sign * ((code[end - 2] << 8) | code[end - 1]);
+  };
+
+  uint8_t instruction = code[offset];
+  printf("%-18s", registerOpcodeName(instruction));
+  switch (instruction)
+  {
+  case ROP_LOAD_CONSTANT:
+  case ROP_MOVE:
+    printf(" r%d = ", code[offset + 1]);
+    operand(code[offset + 2], instruction == ROP_LOAD_CONSTANT);
+    printf("\n");
+    return offset + 3;
+  case ROP_LOAD_NIL:
+  case ROP_LOAD_TRUE:
+  case ROP_LOAD_FALSE:
+    printf(" r%d\n", code[offset + 1]);
+    return offset + 2;
+  case ROP_GET_GLOBAL:
+  case ROP_CLOSURE:
+    printf(" r%d = ", code[offset + 1]);
+    operand(code[offset + 2], true);
+    printf("\n");
+    return offset + 3;
+  case ROP_DEFINE_GLOBAL:
+  case ROP_SET_GLOBAL:
+    printf(" ");
+    operand(code[offset + 1], true);
+    printf(" = ");
+    operand(code[offset + 2], code[offset + 3] & MODE_A_CONSTANT);
+    printf("\n");
+    return offset + 4;
+  case ROP_EQUAL:
+  case ROP_GREATER:
+  case ROP_LESS:
+  case ROP_ADD:
+  case ROP_SUBTRACT:
+  case ROP_MULTIPLY:
+  case ROP_DIVIDE:
+    printf(" r%d = ", code[offset + 1]);
+    operand(code[offset + 2], code[offset + 4] & MODE_A_CONSTANT);
+    printf(", ");
+    operand(code[offset + 3], code[offset + 4] & MODE_B_CONSTANT);
+    printf("\n");
+    return offset + 5;
+  case ROP_NOT:
+  case ROP_NEGATE:
+    printf(" r%d = ", code[offset + 1]);
+    operand(code[offset + 2], code[offset + 3] & MODE_A_CONSTANT);
+    printf("\n");
+    return offset + 4;
+  case ROP_PRINT:
+  case ROP_RETURN:
+    printf(" ");
+    operand(code[offset + 1], code[offset + 2] & MODE_A_CONSTANT);
+    printf("\n");
+    return offset + 3;
+  case ROP_JUMP:
+    printf(" -> %d\n", jumpTarget(offset + 3, 1));
+    return offset + 3;
+  case ROP_LOOP:
+    printf(" -> %d\n", jumpTarget(offset + 3, -1));
+    return offset + 3;
+  case ROP_JUMP_IF_FALSE:
+    printf(" r%d -> %d\n", code[offset + 1], jumpTarget(offset + 4, 1));
+    return offset + 4;
+  case ROP_GREATER_JUMP:
+  case ROP_LESS_JUMP:
+    printf(" ");
+    operand(code[offset + 1], code[offset + 3] & MODE_A_CONSTANT);
+    printf(", ");
+    operand(code[offset + 2], code[offset + 3] & MODE_B_CONSTANT);
+    printf(" -> %d\n", jumpTarget(offset + 6, 1));
+    return offset + 6;
+  case ROP_CALL:
+    printf(" r%d (%d args)\n", code[offset + 1], code[offset + 2]);
+    return offset + 3;
+  default:
+    std::cout << fmt::format("Unknown opcode {}\n", instruction);
+    return offset + 1;
+  }
+}
+
+/**
+ * @brief Adds a value to the constant pool, unless an equal one is already in
+ * it. Values are compared by their bits, so strings match when they're the
+ * same interned object and 0 and -0 stay apart.
+ * @return The index of the value
  */
 int Chunk::addConstant(Value value)
 {
+  auto existing = constantIndex.find(value);
+  if (existing != constantIndex.end()) {
+    constantUses[existing->second]++;
+    return existing->second;
+  }
+
   VM* vm = VM::GetInstance();
-  vm->stack.push_back(value);
+  vm->push(value);
   constants.push_back(value);
-  vm->stack.pop_back();
+  vm->pop();
+  constantUses.push_back(1);
+  constantIndex[value] = constants.size() - 1;
   return constants.size() - 1;
 }
 
-std::vector<int> &Chunk::getLines()
+/**
+ * Takes back one addConstant() of the constant at index, for code the
+ * compiler removed. Constants at the end of the pool that nothing uses
+ * anymore are removed with it.
+ */
+void Chunk::releaseConstant(int index)
 {
-  return lines;
-}
\ No newline at end of file
+  constantUses[index]--;
+  int count = constants.size();
+  while (count > 0 && constantUses[count - 1] == 0) count--;
+  truncate(code.size(), count, caches.size());
+}
+
+// The compiler calls this once it's done with the chunk
+void Chunk::freeConstantIndex()
+{
+  decltype(constantIndex)().swap(constantIndex);
+  CountedVector<int>().swap(constantUses);
+}
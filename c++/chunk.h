@@ -2,8 +2,10 @@
 #define clox_chunk_h
 
 #include "common.h"
+#include "allocator.h"
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 enum OpCode {
   OP_CONSTANT,
@@ -43,10 +45,77 @@ enum OpCode {
   OP_CLASS,
   OP_INHERIT,
   OP_METHOD,
+  // Same as their short forms but with a 2 byte constant index, for chunks
+  // with more than 256 constants
+  OP_CONSTANT_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_GET_PROPERTY_LONG,
+  // Prefix that makes the next instruction's first operand 2 bytes instead of
+  // one. OP_CLOSURE under it also takes 2 byte upvalue indexes.
+  OP_WIDE,
+  // Superinstructions, only ever written by fuseSuperinstructions() in
+  // compiler.cpp over the first instruction of the run they stand for
+  OP_ADD_LOCAL_LOCAL,
+  OP_LESS_LOCAL_CONST_JUMP,
+  OP_INCREMENT_LOCAL,
 };
 
+// Has to stay one past the last OpCode
+#define OPCODE_COUNT (OP_INCREMENT_LOCAL + 1)
+
+const char* opcodeName(uint8_t instruction);
+
+/**
+ * Instructions for the register machine backend (VM::runRegisters(), picked
+ * with --registers). Every operand is a byte naming a register, which is just
+ * a slot in the frame's window of the value stack, so locals are read in
+ * place instead of being pushed first. Instructions that read values take a
+ * trailing mode byte, where MODE_A_CONSTANT/MODE_B_CONSTANT mean that operand
+ * is an index into the constant table instead. Jumps take a 16 bit offset
+ * from the end of the instruction, like the stack code.
+ */
+enum RegisterOpCode {
+  ROP_LOAD_CONSTANT,  // dst, constant
+  ROP_LOAD_NIL,       // dst
+  ROP_LOAD_TRUE,      // dst
+  ROP_LOAD_FALSE,     // dst
+  ROP_MOVE,           // dst, src
+  ROP_GET_GLOBAL,     // dst, name
+  ROP_DEFINE_GLOBAL,  // name, a, mode
+  ROP_SET_GLOBAL,     // name, a, mode
+  ROP_EQUAL,          // dst, a, b, mode
+  ROP_GREATER,        // dst, a, b, mode
+  ROP_LESS,           // dst, a, b, mode
+  ROP_ADD,            // dst, a, b, mode
+  ROP_SUBTRACT,       // dst, a, b, mode
+  ROP_MULTIPLY,       // dst, a, b, mode
+  ROP_DIVIDE,         // dst, a, b, mode
+  ROP_NOT,            // dst, a, mode
+  ROP_NEGATE,         // dst, a, mode
+  ROP_PRINT,          // a, mode
+  ROP_JUMP,           // offset
+  ROP_JUMP_IF_FALSE,  // src, offset
+  ROP_LOOP,           // offset
+  ROP_GREATER_JUMP,   // a, b, mode, offset: jumps unless a > b
+  ROP_LESS_JUMP,      // a, b, mode, offset: jumps unless a < b
+  ROP_CALL,           // base, argCount: callee in base, arguments after it
+  ROP_CLOSURE,        // dst, function
+  ROP_RETURN,         // a, mode
+};
+
+// Has to stay one past the last RegisterOpCode
+#define REGISTER_OPCODE_COUNT (ROP_RETURN + 1)
+
+#define MODE_A_CONSTANT 1
+#define MODE_B_CONSTANT 2
+
+const char* registerOpcodeName(uint8_t instruction);
+
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjShape ObjShape;
 
 #ifdef NAN_BOXING
 
@@ -124,24 +193,125 @@ typedef struct {
 #endif
 
 bool valuesEqual(Value a, Value b);
+
+/**
+ * The bits that make a value what it is, as opposed to valuesEqual(), which
+ * says 0 == -0 and compares strings by content. With the struct form only the
+ * union member the type uses counts, since the rest of it is garbage.
+ */
+static inline uint64_t valueBits(Value value) {
+#ifdef NAN_BOXING
+  return value;
+#else
+  uint64_t bits = 0;
+  switch (value.type) {
+  case VAL_BOOL: bits = value.as.boolean; break;
+  case VAL_NIL: break;
+  case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+  case VAL_OBJ: bits = (uint64_t)(uintptr_t)value.as.obj; break;
+  }
+  return bits ^ ((uint64_t)value.type << 61);
+#endif
+}
+
+// Keys a map by valueBits(), for the constant pool's dedup index
+struct ValueBitsHash {
+  size_t operator()(Value value) const {
+    return std::hash<uint64_t>()(valueBits(value));
+  }
+};
+
+struct ValueBitsEqual {
+  bool operator()(Value a, Value b) const {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    return a.type == b.type && valueBits(a) == valueBits(b);
+#endif
+  }
+};
+
+// How many receiver shapes one inline cache remembers
+#define INLINE_CACHE_SIZE 4
+
+/**
+ * One receiver shape an inline cache has seen. A shape fixes both the class
+ * and the field layout, so matching it is the whole guard. For a field, slot
+ * is its index in the instance. For a method, slot is -1 and method is what
+ * the name resolved to. An OP_SET_PROPERTY that added the field also keeps the
+ * transition it took, so the next instance can go straight to it.
+ */
+typedef struct {
+  ObjShape* shape;
+  int slot;
+  ObjClosure* method;
+  ObjShape* transition;
+} CacheEntry;
+
+/**
+ * The inline cache for one OP_GET_PROPERTY, OP_SET_PROPERTY or OP_INVOKE. The
+ * instruction's last operand is a 2 byte index into Chunk::caches. Once all
+ * the entries are in use, misses replace them round robin. instruction and
+ * line are only there for reporting hit rates.
+ */
+typedef struct {
+  CacheEntry entries[INLINE_CACHE_SIZE];
+  uint8_t count;
+  uint8_t next;
+  uint8_t instruction;
+  int line;
+  uint32_t hits;
+  uint32_t misses;
+} InlineCache;
+
+/**
+ * One run of the line table: the code from offset up to the next run's offset
+ * all came from line.
+ */
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 class Chunk {
 private:
-  std::vector<int> lines;
+  // Run-length encoded, one entry per change of line instead of one per byte
+  CountedVector<LineStart> lines;
   int offset = 0;
-  int constantInstruction(const std::string& name, int offset);
-  int invokeInstruction(const std::string& name, int offset);
-  int byteInstruction(const std::string& name, int offset);
+  int operandAt(int offset, bool wide);
+  int constantInstruction(const std::string& name, int offset, bool wide = false);
+  int invokeInstruction(const std::string& name, int offset, bool wide = false);
+  int cachedInstruction(const std::string& name, int offset, bool wide = false);
+  int closureInstruction(const std::string& name, int offset, bool wide = false);
+  int wideInstruction(int offset);
+  int fusedInstruction(const std::string& name, int offset, int length);
+  int byteInstruction(const std::string& name, int offset, bool wide = false);
   int jumpInstruction(const std::string& name, int sign, int offset);
+  // Only while the chunk is being compiled: the index of every constant by
+  // value, so repeated values share one entry, and how many times the
+  // compiler asked for each one
+  CountedMap<Value, int, ValueBitsHash, ValueBitsEqual> constantIndex;
+  CountedVector<int> constantUses;
 
 public:
-  std::vector<Value> constants;
-  std::vector<uint8_t> code;
+  // Counted as part of the heap, since they belong to an ObjFunction
+  CountedVector<Value> constants;
+  CountedVector<uint8_t> code;
+  CountedVector<InlineCache> caches;
   void writeChunk(uint8_t byte, int line);
   void disassembleChunk(const std::string& name);
   int disassembleInstruction(int offset);
+  void disassembleRegisterChunk(const std::string& name);
+  int disassembleRegisterInstruction(int offset);
   void freeChunk();
   int addConstant(Value value);
-  std::vector<int>& getLines();
+  void releaseConstant(int index);
+  void freeConstantIndex();
+  int addCache(uint8_t instruction);
+  void truncate(int codeCount, int constantCount, int cacheCount);
+  void printCacheStats(const char* name);
+  int getLine(int offset);
+  CountedVector<LineStart>& getLineStarts();
   int count();
 };
 
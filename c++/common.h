@@ -2,14 +2,27 @@
 #define clox_common_h
 
 #include <cstdint>
+#include <cstring>
 
 #define NAN_BOXING
+
+// Release builds (-DNDEBUG, see `make release`) skip all of the debug output.
+// Build with DEFS=-DDEBUG_STRESS_GC to keep the collector running all the
+// time, which is slow but shakes out missing roots and barriers.
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
-#define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#endif
+
+// VM::run() dispatches with GCC/Clang labels-as-values when it can. Build with
+// -DNO_COMPUTED_GOTO to use the portable switch loop instead.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
 #include <fmt/core.h>
 #include "object.h"
 #include "memory.h"
@@ -84,6 +85,8 @@ int Compiler::getLocalCount() {
 
 void Compiler::incLocalCount() {
   localCount++;
+  // addLocal() fills in the slot at localCount, so there's always one spare
+  if (localCount == (int)locals.size()) locals.resize(locals.size() * 2);
 }
 
 void Compiler::decLocalCount() {
@@ -91,7 +94,7 @@ void Compiler::decLocalCount() {
 }
 
 Local* Compiler::getLocals() {
-  return locals;
+  return locals.data();
 }
 
 ObjFunction* Compiler::getFunction() {
@@ -174,7 +177,7 @@ void Parser::advance() {
     current = scanner.scanToken();
     if (current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(current.source);
+    errorAtCurrent(std::string(current.lexeme()));
   }
 }
 
@@ -197,7 +200,7 @@ void Parser::errorAt(Token& token, const std::string& message) {
   } else if (token.type == TOKEN_ERROR) {
     // Nothing
   } else {
-    fprintf(stderr, "%s", fmt::format(" at '{}'", token.source).c_str());
+    fprintf(stderr, "%s", fmt::format(" at '{}'", token.lexeme()).c_str());
   }
 
   fprintf(stderr, ": %s\n", message.c_str());
@@ -219,6 +222,7 @@ void Parser::consume(const TokenType type, const std::string& message) {
 
 void Parser::emitByte(uint8_t byte) {
   currentChunk().writeChunk(byte, previous.line);
+  lastConstant = -1;
 }
 
 void Parser::emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -226,6 +230,18 @@ void Parser::emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+/**
+ * Gives the instruction just emitted its own inline cache and writes the
+ * cache's index as a 2 byte operand.
+ */
+void Parser::emitCache(uint8_t instruction) {
+  int cache = currentChunk().addCache(instruction);
+  if (cache > UINT16_MAX) error("Too many property accesses in one function.");
+
+  emitByte((cache >> 8) & 0xff);
+  emitByte(cache & 0xff);
+}
+
 void Parser::emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
@@ -260,18 +276,170 @@ void Parser::emitReturn() {
   emitByte(OP_RETURN);
 }
 
-uint8_t Parser::makeConstant(Value value) {
+int Parser::makeConstant(Value value) {
   int constant = currentChunk().addConstant(value);
-  if (constant > UINT8_MAX) {
+  if (constant > UINT16_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+/**
+ * Emits instruction with a constant index or local slot as its first
+ * operand. Anything that fits in a byte gets the short form. Past that it's
+ * the _LONG opcode if the instruction has one, or the OP_WIDE prefix, both
+ * with a 2 byte operand.
+ */
+void Parser::emitIndexed(uint8_t instruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(instruction, operand);
+    return;
+  }
+
+  switch (instruction) {
+    case OP_CONSTANT:     emitByte(OP_CONSTANT_LONG); break;
+    case OP_GET_GLOBAL:   emitByte(OP_GET_GLOBAL_LONG); break;
+    case OP_GET_PROPERTY: emitByte(OP_GET_PROPERTY_LONG); break;
+    default:              emitBytes(OP_WIDE, instruction); break;
+  }
+  emitBytes((operand >> 8) & 0xff, operand & 0xff);
 }
 
 void Parser::emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int offset = currentChunk().count();
+  emitIndexed(OP_CONSTANT, makeConstant(value));
+  lastConstant = offset;
+}
+
+static bool isFalseyConstant(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * Emits the instruction that loads a value known at compile time, using the
+ * dedicated instructions for nil and booleans.
+ */
+void Parser::emitValue(Value value) {
+  int offset = currentChunk().count();
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitIndexed(OP_CONSTANT, makeConstant(value));
+  }
+  lastConstant = offset;
+}
+
+/**
+ * True if everything emitted since start is a single instruction loading a
+ * constant, in which case value is set to it. That's how we know an operand
+ * or condition is a literal, or something we already folded into one.
+ */
+bool Parser::tailConstant(int start, Value* value) {
+  if (lastConstant != start) return false;
+  *value = constantAt(start);
+  return true;
+}
+
+// The value loaded by the constant load at offset
+Value Parser::constantAt(int offset) {
+  Chunk& chunk = currentChunk();
+  switch (chunk.code[offset]) {
+    case OP_CONSTANT: return chunk.constants[chunk.code[offset + 1]];
+    case OP_CONSTANT_LONG:
+      return chunk.constants[(chunk.code[offset + 1] << 8) | chunk.code[offset + 2]];
+    case OP_TRUE: return BOOL_VAL(true);
+    case OP_FALSE: return BOOL_VAL(false);
+    default: return NIL_VAL;
+  }
+}
+
+/**
+ * Removes the constant loads emitted since start, along with any entries in
+ * the constant table only they were using.
+ */
+void Parser::dropTail(int start) {
+  Chunk& chunk = currentChunk();
+  for (int offset = start; offset < chunk.count(); offset++) {
+    if (chunk.code[offset] == OP_CONSTANT) {
+      chunk.releaseConstant(chunk.code[++offset]);
+    } else if (chunk.code[offset] == OP_CONSTANT_LONG) {
+      chunk.releaseConstant((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+      offset += 2;
+    }
+  }
+  chunk.truncate(start, chunk.constants.size(), chunk.caches.size());
+  lastConstant = -1;
+}
+
+CodeMark Parser::markCode() {
+  Chunk& chunk = currentChunk();
+  return {chunk.count(), (int)chunk.constants.size(), (int)chunk.caches.size(),
+          Compiler::GetInstance()->getLocalCount()};
+}
+
+/**
+ * Throws away the code compiled since mark, which we still compile so that
+ * errors in it get reported. Any locals it declared go too, the code that
+ * would have popped them is unreachable anyway.
+ */
+void Parser::discardCode(CodeMark mark) {
+  currentChunk().truncate(mark.code, mark.constants, mark.caches);
+  Compiler* compiler = Compiler::GetInstance();
+  while (compiler->getLocalCount() > mark.localCount) compiler->decLocalCount();
+  lastConstant = -1;
+}
+
+/**
+ * Folds `left op right` when both operands are constants and the operation
+ * can't fail, replacing both loads with one for the result. Anything that
+ * would be a runtime error is left for the VM to report.
+ */
+bool Parser::foldBinary(TokenType operatorType, int left) {
+  // The right operand has to be a single constant load too, right after the
+  // left one
+  Value b;
+  uint8_t load = currentChunk().code[left];
+  int right = left + (load == OP_CONSTANT_LONG ? 3 : load == OP_CONSTANT ? 2 : 1);
+  if (!tailConstant(right, &b)) return false;
+  Value a = constantAt(left);
+
+  bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+  Value result;
+  switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL:   result = BOOL_VAL(valuesEqual(a, b)); break;
+    case TOKEN_BANG_EQUAL:    result = BOOL_VAL(!valuesEqual(a, b)); break;
+    case TOKEN_GREATER:       if (!numbers) return false; result = BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b)); break;
+    case TOKEN_GREATER_EQUAL: if (!numbers) return false; result = BOOL_VAL(!(AS_NUMBER(a) < AS_NUMBER(b))); break;
+    case TOKEN_LESS:          if (!numbers) return false; result = BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)); break;
+    case TOKEN_LESS_EQUAL:    if (!numbers) return false; result = BOOL_VAL(!(AS_NUMBER(a) > AS_NUMBER(b))); break;
+    case TOKEN_MINUS:         if (!numbers) return false; result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)); break;
+    case TOKEN_STAR:          if (!numbers) return false; result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b)); break;
+    case TOKEN_SLASH:         if (!numbers) return false; result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)); break;
+    case TOKEN_PLUS:
+      if (numbers) {
+        result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      } else if (IS_STRING(a) && IS_STRING(b)) {
+        // Both operands are still in the constant table if this collects
+        ObjString* first = AS_STRING(a);
+        ObjString* second = AS_STRING(b);
+        std::string chars = std::string(first->chars, first->length) +
+                            std::string(second->chars, second->length);
+        result = OBJ_VAL(copyString(chars.c_str(), chars.length()));
+      } else {
+        return false;
+      }
+      break;
+    default:
+      return false;
+  }
+
+  dropTail(left);
+  emitValue(result);
+  return true;
 }
 
 void Parser::patchJump(int offset) {
@@ -284,29 +452,565 @@ void Parser::patchJump(int offset) {
 
   currentChunk().code[offset] = (jump >> 8) & 0xff;
   currentChunk().code[offset + 1] = jump & 0xff;
+  // Something now lands right after the last instruction, so it's no longer
+  // the whole expression and can't be folded away
+  lastConstant = -1;
+}
+
+/**
+ * How many bytes the instruction at offset takes up, operands included.
+ */
+static int instructionLength(ObjFunction* function, size_t offset) {
+  CountedVector<uint8_t>& code = function->chunk.code;
+  switch (code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SUPER_INVOKE:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return 4;
+    case OP_INVOKE:
+      return 5;
+    case OP_CLOSURE: {
+      ObjFunction* closure = AS_FUNCTION(function->chunk.constants[code[offset + 1]]);
+      return 2 + 2 * closure->upvalueCount;
+    }
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+      return 3;
+    case OP_GET_PROPERTY_LONG:
+      return 5;
+    // The prefix, then the widened instruction with a byte more for its first
+    // operand and, for OP_CLOSURE, for each upvalue index
+    case OP_WIDE: {
+      if (code[offset + 1] == OP_CLOSURE) {
+        int constant = (code[offset + 2] << 8) | code[offset + 3];
+        ObjFunction* closure = AS_FUNCTION(function->chunk.constants[constant]);
+        return 4 + 3 * closure->upvalueCount;
+      }
+      return 2 + instructionLength(function, offset + 1);
+    }
+    default:
+      return 1;
+  }
+}
+
+/**
+ * Walks the finished bytecode once and returns the deepest the operand stack
+ * gets, counting the callee slot and parameters the frame starts with.
+ *
+ * The code is straight-line apart from jumps, and everything we emit is
+ * structured, so the depth at a jump target is the same no matter which way
+ * we got there. We just remember the depth at each forward jump target and
+ * pick it back up when the linear walk reaches it, since the code right
+ * before a target might be the end of the other branch.
+ */
+static int computeMaxStackDepth(ObjFunction* function) {
+  CountedVector<uint8_t>& code = function->chunk.code;
+  std::map<size_t, int> targetDepths;
+  int depth = function->arity + 1;
+  int maxDepth = depth;
+
+  size_t offset = 0;
+  while (offset < code.size()) {
+    auto target = targetDepths.find(offset);
+    if (target != targetDepths.end()) {
+      depth = std::max(depth, target->second);
+    }
+
+    // A widened instruction has the same effect, its operands after the first
+    // one just start 2 bytes later
+    int wide = code[offset] == OP_WIDE;
+    int effect = 0;
+    switch (code[offset + wide]) {
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG:
+      case OP_GET_LOCAL:
+      case OP_GET_GLOBAL:
+      case OP_GET_GLOBAL_LONG:
+      case OP_GET_UPVALUE:
+      case OP_CLASS:
+      case OP_CLOSURE:
+        effect = 1;
+        break;
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_PROPERTY:
+      case OP_GET_SUPER:
+      case OP_METHOD:
+      case OP_POP:
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_PRINT:
+      case OP_CLOSE_UPVALUE:
+      case OP_RETURN:
+      case OP_INHERIT:
+        effect = -1;
+        break;
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE: {
+        size_t jumpTarget = offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+        targetDepths[jumpTarget] = std::max(targetDepths[jumpTarget], depth);
+        break;
+      }
+      // The arguments become the callee's slots, and the result replaces
+      // the callee once it returns
+      case OP_CALL:
+        effect = -code[offset + 1];
+        break;
+      case OP_INVOKE:
+        effect = -code[offset + 2 + 2 * wide];
+        break;
+      case OP_SUPER_INVOKE:
+        effect = -code[offset + 2 + 2 * wide] - 1;
+        break;
+    }
+
+    depth += effect;
+    maxDepth = std::max(maxDepth, depth);
+    offset += instructionLength(function, offset);
+  }
+
+  return maxDepth;
+}
+
+#ifndef NO_SUPERINSTRUCTIONS
+static bool isNumberConstant(ObjFunction* function, uint8_t constant) {
+  return IS_NUMBER(function->chunk.constants[constant]);
+}
+
+/**
+ * Peephole pass that fuses common runs of instructions into the
+ * superinstructions at the end of OpCode. Only the first opcode of a run is
+ * overwritten. Everything after it stays as it was, so jumps into the middle
+ * of a run still land on the original instructions and no offsets change.
+ * When a superinstruction finds something other than numbers in its
+ * operands, it does what the instruction it replaced would have done and
+ * carries on into the rest of the run. Runs after computeMaxStackDepth(),
+ * which only knows the plain instructions.
+ */
+static void fuseSuperinstructions(ObjFunction* function) {
+  CountedVector<uint8_t>& code = function->chunk.code;
+  size_t size = code.size();
+
+  // Compares the opcodes starting at offset against ops
+  auto matches = [&](size_t offset, std::initializer_list<uint8_t> ops) {
+    for (uint8_t op : ops) {
+      if (offset >= size || code[offset] != op) return false;
+      offset += instructionLength(function, offset);
+    }
+    return true;
+  };
+
+  size_t offset = 0;
+  while (offset < size) {
+    int length = instructionLength(function, offset);
+
+    // i = i + k;
+    if (matches(offset, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP}) &&
+        code[offset + 1] == code[offset + 6] && isNumberConstant(function, code[offset + 3])) {
+      code[offset] = OP_INCREMENT_LOCAL;
+      length = 8;
+    // while (i < k), if (i < k)
+    } else if (matches(offset, {OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP}) &&
+               isNumberConstant(function, code[offset + 3])) {
+      // The false branch skips the OP_POP at the jump target too, which only
+      // works if there is one
+      size_t target = offset + 8 + ((code[offset + 6] << 8) | code[offset + 7]);
+      if (target < size && code[target] == OP_POP) {
+        code[offset] = OP_LESS_LOCAL_CONST_JUMP;
+        length = 9;
+      }
+    // a + b
+    } else if (matches(offset, {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD})) {
+      code[offset] = OP_ADD_LOCAL_LOCAL;
+      length = 5;
+    }
+
+    offset += length;
+  }
+}
+#endif
+
+/**
+ * Translates a function's finished stack code into register code for
+ * VM::runRegisters(). Each stack slot becomes the register with the same
+ * number, but instead of emitting the pushes we keep track of where the value
+ * for each slot really is. Constants and locals only get copied into a slot's
+ * register when something needs them there, so `i + 1` is a single ROP_ADD
+ * reading the local's register and the constant, and OP_POP emits nothing.
+ * Every slot is copied into place before a jump and at every jump target, so
+ * all the ways into a target agree on what's in the registers.
+ *
+ * Gives up on anything with upvalues, classes or more than 256 slots, and the
+ * VM runs those on the stack machine instead.
+ */
+class RegisterGenerator {
+private:
+  // Where a stack slot's value is: an entry in the constant table, or a
+  // register. The slot is materialized once it's a register of its own.
+  struct Operand {
+    bool isConstant;
+    uint8_t index;
+  };
+
+  ObjFunction* function;
+  CountedVector<uint8_t>& code;
+  Chunk& out;
+  std::vector<Operand> stack;
+  int line;
+  std::set<size_t> targets;
+  // Stack depth at each forward jump target, and where each target ended up
+  std::map<size_t, size_t> targetDepths;
+  std::map<size_t, size_t> registerOffsets;
+  // Offset operands to patch at the end, with the stack code offset they
+  // jump to
+  std::vector<std::pair<size_t, size_t>> forwardJumps;
+
+  void emit(uint8_t byte) {
+    out.writeChunk(byte, line);
+  }
+
+  static uint8_t modeOf(Operand a, Operand b) {
+    return (a.isConstant ? MODE_A_CONSTANT : 0) | (b.isConstant ? MODE_B_CONSTANT : 0);
+  }
+
+  void load(uint8_t dst, Operand src) {
+    if (src.isConstant) {
+      emit(ROP_LOAD_CONSTANT);
+      emit(dst);
+      emit(src.index);
+    } else if (src.index != dst) {
+      emit(ROP_MOVE);
+      emit(dst);
+      emit(src.index);
+    }
+  }
+
+  void materialize(size_t slot) {
+    load(slot, stack[slot]);
+    stack[slot] = {false, (uint8_t)slot};
+  }
+
+  void materializeAll() {
+    for (size_t slot = 0; slot < stack.size(); slot++) materialize(slot);
+  }
+
+  Operand pop() {
+    Operand operand = stack.back();
+    stack.pop_back();
+    return operand;
+  }
+
+  // Pushes a slot that the next instruction writes to, and returns its register
+  uint8_t pushResult() {
+    uint8_t slot = (uint8_t)stack.size();
+    stack.push_back({false, slot});
+    return slot;
+  }
+
+  void forwardJump(size_t target) {
+    targetDepths[target] = std::max(targetDepths[target], stack.size());
+    forwardJumps.push_back({out.code.size(), target});
+    emit(0xff);
+    emit(0xff);
+  }
+
+  static uint8_t binaryOp(uint8_t instruction) {
+    switch (instruction) {
+      case OP_EQUAL: return ROP_EQUAL;
+      case OP_GREATER: return ROP_GREATER;
+      case OP_LESS: return ROP_LESS;
+      case OP_ADD: return ROP_ADD;
+      case OP_SUBTRACT: return ROP_SUBTRACT;
+      case OP_MULTIPLY: return ROP_MULTIPLY;
+      default: return ROP_DIVIDE;
+    }
+  }
+
+  size_t jumpTarget(size_t offset) {
+    return offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+  }
+
+  /**
+   * A comparison straight into a jump over an OP_POP that also lands on an
+   * OP_POP, which is how every if, while and for condition compiles, becomes
+   * one compare-and-jump. The popped result never needs to exist.
+   */
+  bool fusesWithJump(size_t offset) {
+    if (offset + 5 > code.size() || code[offset + 1] != OP_JUMP_IF_FALSE ||
+        code[offset + 4] != OP_POP || targets.count(offset + 1) || targets.count(offset + 4)) {
+      return false;
+    }
+    size_t target = jumpTarget(offset + 1);
+    return target < code.size() && code[target] == OP_POP;
+  }
+
+public:
+  RegisterGenerator(ObjFunction* function)
+      : function(function), code(function->chunk.code), out(function->registerChunk), line(0) {}
+
+  bool generate() {
+    if (function->maxStackDepth > UINT8_COUNT) return false;
+
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(function, offset)) {
+      if (code[offset] == OP_JUMP || code[offset] == OP_JUMP_IF_FALSE) {
+        targets.insert(jumpTarget(offset));
+      } else if (code[offset] == OP_LOOP) {
+        targets.insert(offset + 3 - ((code[offset + 1] << 8) | code[offset + 2]));
+      }
+    }
+
+    // The callee and the arguments are already in place
+    for (int slot = 0; slot <= function->arity; slot++) pushResult();
+
+    CountedVector<Value>& constants = function->chunk.constants;
+    size_t offset = 0;
+    while (offset < code.size()) {
+      line = function->chunk.getLine(offset);
+      if (targets.count(offset)) {
+        materializeAll();
+        auto depth = targetDepths.find(offset);
+        if (depth != targetDepths.end()) {
+          while (stack.size() < depth->second) pushResult();
+        }
+        registerOffsets[offset] = out.code.size();
+      }
+
+      uint8_t instruction = code[offset];
+      switch (instruction) {
+        case OP_CONSTANT:
+          stack.push_back({true, code[offset + 1]});
+          break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+          emit(instruction == OP_NIL ? ROP_LOAD_NIL : instruction == OP_TRUE ? ROP_LOAD_TRUE : ROP_LOAD_FALSE);
+          emit(pushResult());
+          break;
+        case OP_POP:
+          stack.pop_back();
+          break;
+        case OP_GET_LOCAL: {
+          uint8_t slot = code[offset + 1];
+          materialize(slot);
+          stack.push_back({false, slot});
+          break;
+        }
+        case OP_SET_LOCAL: {
+          // Anything still reading the old value has to copy it out first
+          uint8_t slot = code[offset + 1];
+          for (size_t other = 0; other < stack.size(); other++) {
+            if (other != slot && !stack[other].isConstant && stack[other].index == slot) {
+              materialize(other);
+            }
+          }
+          load(slot, stack.back());
+          stack[slot] = {false, slot};
+          break;
+        }
+        case OP_GET_GLOBAL:
+          emit(ROP_GET_GLOBAL);
+          emit(pushResult());
+          emit(code[offset + 1]);
+          break;
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL: {
+          Operand value = instruction == OP_DEFINE_GLOBAL ? pop() : stack.back();
+          emit(instruction == OP_DEFINE_GLOBAL ? ROP_DEFINE_GLOBAL : ROP_SET_GLOBAL);
+          emit(code[offset + 1]);
+          emit(value.index);
+          emit(modeOf(value, {false, 0}));
+          break;
+        }
+        case OP_GREATER:
+        case OP_LESS:
+          if (fusesWithJump(offset)) {
+            Operand b = pop();
+            Operand a = pop();
+            materializeAll();
+            emit(instruction == OP_LESS ? ROP_LESS_JUMP : ROP_GREATER_JUMP);
+            emit(a.index);
+            emit(b.index);
+            emit(modeOf(a, b));
+            // Stands in for the comparison's result, which both ways out pop
+            pushResult();
+            forwardJump(jumpTarget(offset + 1));
+            offset += 4;
+            continue;
+          }
+          // Fall through
+        case OP_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+          Operand b = pop();
+          Operand a = pop();
+          emit(binaryOp(instruction));
+          emit(pushResult());
+          emit(a.index);
+          emit(b.index);
+          emit(modeOf(a, b));
+          break;
+        }
+        case OP_NOT:
+        case OP_NEGATE: {
+          Operand a = pop();
+          emit(instruction == OP_NOT ? ROP_NOT : ROP_NEGATE);
+          emit(pushResult());
+          emit(a.index);
+          emit(modeOf(a, {false, 0}));
+          break;
+        }
+        case OP_PRINT:
+        case OP_RETURN: {
+          Operand a = pop();
+          emit(instruction == OP_PRINT ? ROP_PRINT : ROP_RETURN);
+          emit(a.index);
+          emit(modeOf(a, {false, 0}));
+          break;
+        }
+        case OP_JUMP:
+          materializeAll();
+          emit(ROP_JUMP);
+          forwardJump(jumpTarget(offset));
+          break;
+        case OP_JUMP_IF_FALSE:
+          materializeAll();
+          emit(ROP_JUMP_IF_FALSE);
+          emit(stack.size() - 1);
+          forwardJump(jumpTarget(offset));
+          break;
+        case OP_LOOP: {
+          materializeAll();
+          emit(ROP_LOOP);
+          size_t target = registerOffsets[offset + 3 - ((code[offset + 1] << 8) | code[offset + 2])];
+          size_t jump = out.code.size() + 2 - target;
+          if (jump > UINT16_MAX) return false;
+          emit((jump >> 8) & 0xff);
+          emit(jump & 0xff);
+          break;
+        }
+        case OP_CALL: {
+          // The callee's frame starts at base, so everything has to be in place
+          uint8_t argCount = code[offset + 1];
+          size_t base = stack.size() - argCount - 1;
+          for (size_t slot = base; slot < stack.size(); slot++) materialize(slot);
+          stack.resize(base);
+          emit(ROP_CALL);
+          emit(pushResult());
+          emit(argCount);
+          break;
+        }
+        case OP_CLOSURE: {
+          ObjFunction* nested = AS_FUNCTION(constants[code[offset + 1]]);
+          if (nested->upvalueCount > 0 || nested->registerChunk.code.empty()) return false;
+          emit(ROP_CLOSURE);
+          emit(pushResult());
+          emit(code[offset + 1]);
+          break;
+        }
+        default:
+          return false;
+      }
+
+      offset += instructionLength(function, offset);
+    }
+
+    for (auto& [at, target] : forwardJumps) {
+      size_t jump = registerOffsets[target] - (at + 2);
+      if (jump > UINT16_MAX) return false;
+      out.code[at] = (jump >> 8) & 0xff;
+      out.code[at + 1] = jump & 0xff;
+    }
+    out.constants = constants;
+    return true;
+  }
+};
+
+/**
+ * Fills in function->registerChunk, or leaves it empty if the function uses
+ * something the register machine can't do.
+ */
+static void generateRegisterCode(ObjFunction* function) {
+  RegisterGenerator generator(function);
+  if (!generator.generate()) {
+    function->registerChunk = Chunk();
+  }
 }
 
 ObjFunction* Parser::endCompiler() {
   emitReturn();
   Compiler* compiler = Compiler::GetInstance();
   ObjFunction* function = compiler->getFunction();
+  function->maxStackDepth = computeMaxStackDepth(function);
+  // Translates the plain stack code, so this has to come before fusing
+  if (VM::GetInstance()->useRegisters && !hadError) {
+    generateRegisterCode(function);
+  }
+#ifndef NO_SUPERINSTRUCTIONS
+  fuseSuperinstructions(function);
+#endif
 #ifdef DEBUG_PRINT_CODE
   if (hadError) {
     std::cout << "finished with errors\n";
   }
   currentChunk().disassembleChunk(function->name != NULL ? function->name->chars : "script");
+  std::cout << "max stack depth " << function->maxStackDepth << "\n";
+  if (!function->registerChunk.code.empty()) {
+    function->registerChunk.disassembleRegisterChunk(function->name != NULL ? function->name->chars : "script");
+  }
 #endif
+  function->chunk.freeConstantIndex();
   // We exit the scope of the previous compiler
   Compiler::popCompiler();
   return function;
 }
 
 void Parser::number(bool canAssign) {
-  double value = std::stod(previous.source.substr(previous.start, previous.length));
+  double value = std::stod(std::string(previous.lexeme()));
   emitConstant(NUMBER_VAL(value));
 }
 
 void Parser::or_(bool canAssign) {
+  Value left;
+  int start = lastConstant;
+  if (start != -1 && tailConstant(start, &left)) {
+    if (!isFalseyConstant(left)) {
+      CodeMark mark = markCode();
+      parsePrecedence(PREC_OR);
+      discardCode(mark);
+      lastConstant = start;
+    } else {
+      dropTail(start);
+      parsePrecedence(PREC_OR);
+    }
+    return;
+  }
+
   auto elseJump = emitJump(OP_JUMP_IF_FALSE);
   auto endJump = emitJump(OP_JUMP);
 
@@ -318,17 +1022,17 @@ void Parser::or_(bool canAssign) {
 }
 
 void Parser::string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(previous.source.substr(previous.start+1, previous.length-2).c_str(), previous.length - 2)));
+  emitConstant(OBJ_VAL(copyString(previous.lexeme().data() + 1, previous.length - 2)));
 }
 
 void Parser::variable(bool canAssign) {
   namedVariable(previous, canAssign);
 }
 
-Token Parser::syntheticToken(const std::string& text) {
+Token Parser::syntheticToken(const char* text) {
   Token token;
   token.source = text;
-  token.length = text.length();
+  token.length = token.source.length();
   return token;
 }
 
@@ -341,17 +1045,17 @@ void Parser::super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&previous);
+  int name = identifierConstant(&previous);
 
   namedVariable(syntheticToken("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitIndexed(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitIndexed(OP_GET_SUPER, name);
   }
 }
 
@@ -381,9 +1085,9 @@ void Parser::namedVariable(Token name, bool canAssign) {
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, arg);
+    emitIndexed(setOp, arg);
   } else {
-    emitBytes(getOp, arg);
+    emitIndexed(getOp, arg);
   }
 }
 
@@ -396,8 +1100,22 @@ void Parser::unary(bool canAssign) {
   TokenType operatorType = previous.type;
 
   // Compile the operand
+  int start = currentChunk().count();
   parsePrecedence(PREC_UNARY);
 
+  Value operand;
+  if (tailConstant(start, &operand)) {
+    if (operatorType == TOKEN_BANG) {
+      dropTail(start);
+      emitValue(BOOL_VAL(isFalseyConstant(operand)));
+      return;
+    } else if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      dropTail(start);
+      emitValue(NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   // Emit the operator instruction
   switch(operatorType) {
     case TOKEN_BANG:
@@ -417,6 +1135,22 @@ static ParseRule& getRule(TokenType type) {
 }
 
 void Parser::and_(bool canAssign) {
+  // With a constant on the left we know which side is the result
+  Value left;
+  int start = lastConstant;
+  if (start != -1 && tailConstant(start, &left)) {
+    if (isFalseyConstant(left)) {
+      CodeMark mark = markCode();
+      parsePrecedence(PREC_AND);
+      discardCode(mark);
+      lastConstant = start;
+    } else {
+      dropTail(start);
+      parsePrecedence(PREC_AND);
+    }
+    return;
+  }
+
   auto endJump = emitJump(OP_JUMP_IF_FALSE);
 
   emitByte(OP_POP);
@@ -428,7 +1162,10 @@ void Parser::and_(bool canAssign) {
 void Parser::binary(bool canAssign) {
   TokenType operatorType = previous.type;
   ParseRule rule = getRule(operatorType);
+  // Only a left operand that's a single constant load can be folded
+  int left = lastConstant;
   parsePrecedence((Precedence)(rule.getPrecedence() + 1));
+  if (left != -1 && foldBinary(operatorType, left)) return;
 
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
@@ -454,25 +1191,28 @@ void Parser::call(bool canAssign) {
 
 void Parser::dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
-  uint8_t name = identifierConstant(&previous);
+  int name = identifierConstant(&previous);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitIndexed(OP_SET_PROPERTY, name);
+    emitCache(OP_SET_PROPERTY);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitIndexed(OP_INVOKE, name);
     emitByte(argCount);
+    emitCache(OP_INVOKE);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitIndexed(OP_GET_PROPERTY, name);
+    emitCache(OP_GET_PROPERTY);
   }
 }
 
 void Parser::literal(bool canAssign) {
   switch (previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
+    case TOKEN_FALSE: emitValue(BOOL_VAL(false)); break;
+    case TOKEN_TRUE: emitValue(BOOL_VAL(true)); break;
+    case TOKEN_NIL: emitValue(NIL_VAL); break;
     default: 
       error("This should not be reachable in literal types");
       return;
@@ -507,14 +1247,29 @@ void Parser::expression() {
 
 void Parser::block() {
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    bool returns = check(TOKEN_RETURN);
     declaration();
+
+    // Nothing after a return in the same block can run
+    if (returns && !check(TOKEN_RIGHT_BRACE)) {
+      CodeMark mark = markCode();
+      while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        declaration();
+      }
+      discardCode(mark);
+    }
   }
 
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 void Parser::function(FunctionType type) {
-  Compiler* compiler = Compiler::GetInstance(true, TYPE_FUNCTION, copyString(previous.source.substr(previous.start, previous.length).c_str(), previous.length));
+  // The name isn't reachable from anything until the new compiler's function
+  // holds it, and making that function can trigger a GC
+  VM* vm = VM::GetInstance();
+  vm->push(OBJ_VAL(copyString(previous.lexeme().data(), previous.length)));
+  Compiler* compiler = Compiler::GetInstance(true, type, AS_STRING(vm->peek(0)));
+  vm->pop();
   compiler->beginScope();
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -524,7 +1279,7 @@ void Parser::function(FunctionType type) {
       if (compiler->getFunction()->arity > 255) {
         errorAtCurrent("Functions can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -532,43 +1287,56 @@ void Parser::function(FunctionType type) {
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
   block();
 
+  // endCompiler() deletes the compiler, so grab the upvalues before that
+  std::vector<Upvalue> upvalues(compiler->getUpvalues(), compiler->getUpvalues() + compiler->getFunction()->upvalueCount);
   ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  int constant = makeConstant(OBJ_VAL(function));
 
-  for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler->getUpvalues()[i].isLocal ? 1 : 0);
-    emitByte(compiler->getUpvalues()[i].index);
+  // Under OP_WIDE the upvalue indexes are 2 bytes as well, for capturing
+  // locals past slot 255
+  bool wide = constant > UINT8_MAX;
+  for (const Upvalue& upvalue : upvalues) {
+    if (upvalue.index > UINT8_MAX) wide = true;
+  }
+  if (wide) emitByte(OP_WIDE);
+  emitByte(OP_CLOSURE);
+  if (wide) emitByte((constant >> 8) & 0xff);
+  emitByte(constant & 0xff);
+
+  for (const Upvalue& upvalue : upvalues) {
+    emitByte(upvalue.isLocal ? 1 : 0);
+    if (wide) emitByte((upvalue.index >> 8) & 0xff);
+    emitByte(upvalue.index & 0xff);
   }
 }
 
 void Parser::funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
 }
 
 void Parser::method() {
-  Compiler* compiler = Compiler::GetInstance();
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&previous);
+  int constant = identifierConstant(&previous);
   
   FunctionType type = TYPE_METHOD;
-  if (previous.length == 4 && previous.source == "init") {
-    compiler->setType(TYPE_INITIALIZER);
+  if (previous.length == 4 && previous.lexeme() == "init") {
+    type = TYPE_INITIALIZER;
   }
 
   function(type); 
-  emitBytes(OP_METHOD, constant);
+  emitIndexed(OP_METHOD, constant);
 }
 
 void Parser::classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = previous;
-  uint8_t nameConstant = identifierConstant(&previous);
+  int nameConstant = identifierConstant(&previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
+  emitIndexed(OP_CLASS, nameConstant);
   defineVariable(nameConstant);
 
   Compiler* compiler = Compiler::GetInstance();
@@ -582,7 +1350,7 @@ void Parser::classDeclaration() {
     variable(false);
 
     if (identifiersEqual(className, previous)) {
-      error(fmt::format("A class can't inherit from itself {}", className.source));
+      error(fmt::format("A class can't inherit from itself {}", className.lexeme()));
     }
 
     compiler->beginScope();
@@ -630,14 +1398,24 @@ void Parser::forStatement() {
 
   int loopStart = currentChunk().count();
   int exitJump = -1;
+  bool neverRuns = false;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");    
 
-    // Jump out of the loop if the condition is false
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    Value condition;
+    if (tailConstant(loopStart, &condition)) {
+      // Always true is the same as no condition, always false means only
+      // the initializer ever runs
+      dropTail(loopStart);
+      neverRuns = isFalseyConstant(condition);
+    } else {
+      // Jump out of the loop if the condition is false
+      exitJump = emitJump(OP_JUMP_IF_FALSE);
+      emitByte(OP_POP);
+    }
   }
+  CodeMark loop = markCode();
 
   if (!match(TOKEN_RIGHT_PAREN)) {
     auto bodyJump = emitJump(OP_JUMP);
@@ -653,6 +1431,7 @@ void Parser::forStatement() {
 
   statement();
   emitLoop(loopStart);
+  if (neverRuns) discardCode(loop);
 
   if (exitJump != -1) {
     patchJump(exitJump);
@@ -664,9 +1443,28 @@ void Parser::forStatement() {
 
 void Parser::ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  int conditionStart = currentChunk().count();
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
 
+  // A constant condition means only one branch can ever run, so the other
+  // one and the jumps around it go
+  Value condition;
+  if (tailConstant(conditionStart, &condition)) {
+    dropTail(conditionStart);
+    bool taken = !isFalseyConstant(condition);
+
+    CodeMark mark = markCode();
+    statement();
+    if (!taken) discardCode(mark);
+    if (match(TOKEN_ELSE)) {
+      mark = markCode();
+      statement();
+      if (taken) discardCode(mark);
+    }
+    return;
+  }
+
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
   statement();
@@ -713,6 +1511,19 @@ void Parser::whileStatement() {
   expression(); 
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  Value condition;
+  if (tailConstant(loopStart, &condition)) {
+    dropTail(loopStart);
+    CodeMark mark = markCode();
+    statement();
+    if (isFalseyConstant(condition)) {
+      discardCode(mark);
+    } else {
+      emitLoop(loopStart);
+    }
+    return;
+  }
+
   auto exitJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
   statement();
@@ -747,7 +1558,7 @@ void Parser::synchronize() {
 }
 
 void Parser::varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -759,7 +1570,7 @@ void Parser::varDeclaration() {
   defineVariable(global);
 }
 
-uint8_t Parser::parseVariable(const char* errorMessage) {
+int Parser::parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   Compiler* compiler = Compiler::GetInstance();
@@ -775,13 +1586,13 @@ void Parser::markInitialized() {
   compiler->getLocals()[compiler->getLocalCount() - 1].depth = compiler->getScopeDepth();
 }
 
-uint8_t Parser::identifierConstant(Token *name) {
-  return makeConstant(OBJ_VAL(copyString(name->source.c_str(), name->length)));
+int Parser::identifierConstant(Token *name) {
+  return makeConstant(OBJ_VAL(copyString(name->lexeme().data(), name->length)));
 }
 
 bool Parser::identifiersEqual(Token a, Token b) {
   if (a.length != b.length) return false;
-  return a.source == b.source;
+  return a.lexeme() == b.lexeme();
 }
 
 int Parser::resolveLocal(Compiler* compiler, Token* name) {
@@ -798,7 +1609,7 @@ int Parser::resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
   
-int Parser::addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+int Parser::addUpvalue(Compiler* compiler, int index, bool isLocal) {
   int upvalueCount = compiler->getFunction()->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {
@@ -824,12 +1635,12 @@ int Parser::resolveUpvalue(Compiler* compiler, Token* name) {
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->getLocals()[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, local, true);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, upvalue, false);
   }
 
   return -1;
@@ -846,7 +1657,7 @@ void Parser::declareVariable() {
     }
 
     if (identifiersEqual(previous, local->name)) {
-      error(fmt::format("Already a variable with name '{}' in this scope.", previous.source));
+      error(fmt::format("Already a variable with name '{}' in this scope.", previous.lexeme()));
     }
   }
   addLocal(previous);
@@ -854,7 +1665,7 @@ void Parser::declareVariable() {
 
 void Parser::addLocal(Token name) {
   Compiler* compiler = Compiler::GetInstance();
-  if (compiler->getLocalCount() == UINT8_COUNT) {
+  if (compiler->getLocalCount() == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
@@ -863,16 +1674,17 @@ void Parser::addLocal(Token name) {
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  compiler->incLocalCount();
 }
 
-void Parser::defineVariable(uint8_t global) {
+void Parser::defineVariable(int global) {
   Compiler* compiler = Compiler::GetInstance();
   if (compiler->getScopeDepth() > 0) {
     markInitialized();
     return;
   }
   
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 uint8_t Parser::argumentList() {
@@ -933,25 +1745,26 @@ bool Parser::check(TokenType type) {
   return current.type == type;
 }
 
-ObjFunction* compile(std::string& source, Chunk& chunk) {
+ObjFunction* compile(std::string_view source, Chunk& chunk) {
   Scanner scanner(source);
   auto current = Token(TOKEN_EOF, 0, 0, 0, source);
   auto previous = Token(TOKEN_EOF, 0, 0, 0, source);
   Parser parser(current, previous, scanner, chunk);
+  // Make the script's compiler up front. Made lazily, its function could
+  // trigger a GC while the first constant is only held in a local.
+  Compiler::GetInstance();
   parser.advance();
 
   while (!parser.match(TOKEN_EOF)) {
     parser.declaration();
   }
 
-  parser.endCompiler();
-
   ObjFunction* function = parser.endCompiler();
   return parser.getHadError() ? NULL : function;
 }
 
 void markCompilerRoots() {
-  Compiler* compiler = Compiler::GetInstance();
+  Compiler* compiler = Compiler::getCurrent();
   while (compiler != NULL) {
     markObject((Obj*)compiler->getFunction());
     compiler = compiler->enclosing;
@@ -30,7 +30,19 @@ typedef enum
   TYPE_SCRIPT,
 } FunctionType;
 
-ObjFunction *compile(std::string &source, Chunk &chunk);
+/**
+ * How far the current function's code had got at some point, so code that
+ * turns out to be unreachable can be compiled (for its errors) and then thrown
+ * away again with Parser::discardCode().
+ */
+typedef struct {
+  int code;
+  int constants;
+  int caches;
+  int localCount;
+} CodeMark;
+
+ObjFunction *compile(std::string_view source, Chunk &chunk);
 void markCompilerRoots();
 
 class Compiler;
@@ -60,11 +72,22 @@ private:
   Chunk compilingChunk;
   bool hadError;
   bool panicMode;
+  // Offset of the last instruction emitted if it loads a constant, else -1.
+  // Anything else emitted, or a jump landing after it, resets it.
+  int lastConstant;
+
+  bool tailConstant(int start, Value* value);
+  Value constantAt(int offset);
+  void dropTail(int start);
+  void emitValue(Value value);
+  bool foldBinary(TokenType operatorType, int left);
+  CodeMark markCode();
+  void discardCode(CodeMark mark);
 
 public:
-  Parser(Token &current, Token &previous, Scanner &scanner, Chunk &chunk) : current(current), previous(previous), scanner(scanner), compilingChunk(chunk), hadError(false), panicMode(false) {}
+  Parser(Token &current, Token &previous, Scanner &scanner, Chunk &chunk) : current(current), previous(previous), scanner(scanner), compilingChunk(chunk), hadError(false), panicMode(false), lastConstant(-1) {}
   Chunk &currentChunk();
-  uint8_t makeConstant(Value value);
+  int makeConstant(Value value);
   void advance();
   void expression();
   void consume(const TokenType type, const std::string &message);
@@ -74,6 +97,8 @@ public:
   bool getHadError();
   void emitByte(uint8_t byte);
   void emitBytes(uint8_t byte1, uint8_t byte2);
+  void emitIndexed(uint8_t instruction, int operand);
+  void emitCache(uint8_t instruction);
   int emitJump(uint8_t instruction);
   void patchJump(int offset);
   void emitReturn();
@@ -95,9 +120,9 @@ public:
   void ifStatement();
   void synchronize();
   void varDeclaration();
-  uint8_t parseVariable(const char *errorMessage);
-  uint8_t identifierConstant(Token *name);
-  void defineVariable(uint8_t global);
+  int parseVariable(const char *errorMessage);
+  int identifierConstant(Token *name);
+  void defineVariable(int global);
   void variable(bool canAssign);
   void namedVariable(Token name, bool canAssign);
   void block();
@@ -117,13 +142,13 @@ public:
   uint8_t argumentList();
   void returnStatement();
   int resolveUpvalue(Compiler *compiler, Token *name);
-  int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal);
+  int addUpvalue(Compiler *compiler, int index, bool isLocal);
   void classDeclaration();
   void dot(bool canAssign);
   void method();
   void this_(bool canAssign);
   void super_(bool canAssign);
-  Token syntheticToken(const std::string& text);
+  Token syntheticToken(const char* text);
 };
 
 using ParseFn = void (Parser::*)(bool canAssign);
@@ -160,7 +185,7 @@ public:
 class Upvalue
 {
 public:
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 };
 
@@ -170,7 +195,8 @@ private:
   ObjFunction *function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  // Starts with UINT8_COUNT slots and grows when a function needs more
+  std::vector<Local> locals;
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
@@ -185,12 +211,8 @@ private:
     // So this is kinda bad, I think the default constructor will make
     // everything a TYPE_FUNCTION. So to fix this if we get the other type, I
     // will override all of them. TODO: I also don't know if I'm creating the local.name correctly
-    if (type != TYPE_FUNCTION) {
-      for (size_t i = 0; i < UINT8_COUNT; i++) {
-        this->locals[i] = Local(type);
-      }
-    }
-    Local local = this->locals[this->localCount++];
+    this->locals.resize(UINT8_COUNT, Local(type));
+    Local& local = this->locals[this->localCount++];
     local.depth = 0;
     local.name = Token();
     if (type != TYPE_FUNCTION) {
@@ -208,6 +230,9 @@ public:
   Compiler(Compiler &other) = delete;
   void operator=(const Compiler &) = delete;
   static Compiler *GetInstance(bool newInstance, FunctionType type, ObjString *functionName);
+  // The innermost compiler, or NULL when nothing is being compiled. Unlike
+  // GetInstance() this never makes one, so the GC can call it.
+  static Compiler *getCurrent() { return compiler_; }
   static void popCompiler();
   ~Compiler() {}
   void beginScope();
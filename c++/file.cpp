@@ -0,0 +1,42 @@
+#include "file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path)
+    : mapping(MAP_FAILED), length(0), opened(false) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  opened = true;
+
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    // mmap() refuses empty files, which are fine as they are
+    length = info.st_size;
+    if (length > 0) mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (length == 0 || mapping != MAP_FAILED) {
+      close(fd);
+      return;
+    }
+  }
+
+  char chunk[4096];
+  ssize_t count;
+  while ((count = read(fd, chunk, sizeof(chunk))) > 0) buffer.append(chunk, count);
+  length = buffer.size();
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (mapping != MAP_FAILED) munmap(mapping, length);
+}
+
+const uint8_t* MappedFile::bytes() const {
+  if (mapping != MAP_FAILED) return (const uint8_t*)mapping;
+  return (const uint8_t*)buffer.data();
+}
+
+size_t MappedFile::size() const {
+  return length;
+}
@@ -0,0 +1,34 @@
+#ifndef clox_file_h
+#define clox_file_h
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * A whole file mapped read only into memory for as long as this lives, so
+ * reading it copies nothing and the OS only pages in what gets touched. Files
+ * that can't be mapped, like pipes, get read into a buffer instead.
+ */
+class MappedFile {
+  private:
+    void* mapping;
+    size_t length;
+    std::string buffer;
+    bool opened;
+
+  public:
+    MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    void operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const uint8_t* bytes() const;
+    size_t size() const;
+    std::string_view text() const {
+      return std::string_view((const char*)bytes(), size());
+    }
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+/**
+ * The book's FNV-1a. Simple, but it's one byte and one dependent multiply at
+ * a time, so it gets slow on long strings.
+ */
+static inline uint32_t hashFnv1a(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ull
+
+static inline uint64_t hashMixWord(uint64_t hash, uint64_t word) {
+  hash = (hash ^ word) * HASH_MULTIPLIER;
+  return hash ^ (hash >> 32);
+}
+
+static inline uint64_t hashLoad64(const char* key) {
+  uint64_t word;
+  memcpy(&word, key, 8);
+  return word;
+}
+
+static inline uint64_t hashLoad32(const char* key) {
+  uint32_t word;
+  memcpy(&word, key, 4);
+  return word;
+}
+
+/**
+ * Packs the last 1 to 7 bytes into a word with fixed-size loads, which may
+ * overlap, rather than a variable-length memcpy.
+ */
+static inline uint64_t hashLoadTail(const char* key, int length) {
+  if (length >= 4) {
+    return (hashLoad32(key) << 32) | hashLoad32(key + length - 4);
+  }
+  return ((uint64_t)(uint8_t)key[0] << 16) |
+         ((uint64_t)(uint8_t)key[length >> 1] << 8) |
+         (uint8_t)key[length - 1];
+}
+
+/**
+ * Hashes 8 bytes per step. Past 32 bytes it runs four independent lanes so
+ * the multiplies can overlap, then folds them together. The final mix pushes
+ * the high bits down, since tables only look at the low bits of the hash.
+ */
+static inline uint32_t hashWordwise(const char* key, int length) {
+  uint64_t hash = (uint64_t)length * HASH_MULTIPLIER;
+  int i = 0;
+
+  if (length >= 64) {
+    uint64_t lane0 = hash, lane1 = hash + 1, lane2 = hash + 2, lane3 = hash + 3;
+    for (; i + 32 <= length; i += 32) {
+      lane0 = hashMixWord(lane0, hashLoad64(key + i));
+      lane1 = hashMixWord(lane1, hashLoad64(key + i + 8));
+      lane2 = hashMixWord(lane2, hashLoad64(key + i + 16));
+      lane3 = hashMixWord(lane3, hashLoad64(key + i + 24));
+    }
+    hash = hashMixWord(hashMixWord(lane0, lane1), hashMixWord(lane2, lane3));
+  }
+
+  for (; i + 8 <= length; i += 8) {
+    hash = hashMixWord(hash, hashLoad64(key + i));
+  }
+
+  if (i < length) {
+    hash = hashMixWord(hash, hashLoadTail(key + i, length - i));
+  }
+
+  hash *= HASH_MULTIPLIER;
+  hash ^= hash >> 29;
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * The hash used for interning and table lookups. Build with -DFNV1A_HASH to
+ * go back to FNV-1a. Never returns 0, since ObjString uses a 0 hash to mean
+ * it hasn't been hashed.
+ */
+static inline uint32_t hashString(const char* key, int length) {
+#ifdef FNV1A_HASH
+  uint32_t hash = hashFnv1a(key, length);
+#else
+  uint32_t hash = hashWordwise(key, length);
+#endif
+  return hash == 0 ? 1 : hash;
+}
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Cell sizes in granules. The steps get coarser as the cells get bigger, so
+// rounding an object up to its cell never wastes more than a quarter of it.
+static const uint8_t CLASS_GRANULES[SIZE_CLASS_COUNT] = {
+  1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, 28, 32, 40, 48, 56, 64, 80, 96, 112, 128,
+};
+
+// The size class for an object of each size, in granules
+static uint8_t classByGranules[MAX_CELL_SIZE / GRANULE_SIZE + 1];
+
+void initSizeClasses(SizeClass* classes) {
+  int sizeClass = 0;
+  for (int granules = 0; granules <= MAX_CELL_SIZE / GRANULE_SIZE; granules++) {
+    if (granules > CLASS_GRANULES[sizeClass]) sizeClass++;
+    classByGranules[granules] = sizeClass;
+  }
+
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    classes[i].cellSize = CLASS_GRANULES[i] * GRANULE_SIZE;
+    classes[i].freeCells = NULL;
+    classes[i].current = NULL;
+    classes[i].swept = NULL;
+    classes[i].unswept = NULL;
+    classes[i].full = NULL;
+#ifdef HEAP_STATS
+    classes[i].allocations = 0;
+#endif
+  }
+}
+
+static inline SizeClass* sizeClassOf(size_t size) {
+  return &VM::GetInstance()->sizeClasses[classByGranules[(size + GRANULE_SIZE - 1) / GRANULE_SIZE]];
+}
+
+static inline Obj* cellAt(Page* page, uint32_t cell) {
+  return (Obj*)((uint8_t*)page + FIRST_CELL + (size_t)cell * page->cellSize);
+}
+
+static inline Obj* objectAt(Page* page, size_t granule) {
+  return (Obj*)((uint8_t*)page + granule * GRANULE_SIZE);
+}
+
+static void pushPage(Page** list, Page* page) {
+  page->next = *list;
+  *list = page;
+}
+
+static Page* popPage(Page** list) {
+  Page* page = *list;
+  if (page != NULL) {
+    *list = page->next;
+    page->next = NULL;
+  }
+  return page;
+}
+
+/**
+ * A page of cells of cellSize bytes, or for a large object bigger than any
+ * cell, a page of one cell spanning as many HEAP_PAGE_SIZE blocks as it
+ * needs. Either way the object starts in the first block, so pageOf() finds
+ * the header.
+ *
+ * Ordinary pages come out of the empty page pool when there are any, since
+ * those are already cleared and don't need to go through the system
+ * allocator. An empty page can take any size class.
+ */
+static Page* newPage(uint32_t cellSize) {
+  auto vm = VM::GetInstance();
+  bool large = cellSize > MAX_CELL_SIZE;
+  Page* page = NULL;
+  if (!large && vm->emptyPages != NULL) {
+    page = popPage(&vm->emptyPages);
+    vm->emptyPageCount--;
+  } else {
+    size_t bytes = HEAP_PAGE_SIZE;
+    if (large) bytes = (FIRST_CELL + cellSize + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+
+    page = (Page*)aligned_alloc(HEAP_PAGE_SIZE, bytes);
+    if (page == NULL) exit(1);
+    page->next = NULL;
+    memset(page->live, 0, sizeof(page->live));
+    memset(page->marks, 0, sizeof(page->marks));
+    memset(page->owners, 0, sizeof(page->owners));
+  }
+  page->cellSize = cellSize;
+  page->cellCount = large ? 1 : (HEAP_PAGE_SIZE - FIRST_CELL) / cellSize;
+  page->liveCount = 0;
+  return page;
+}
+
+// Keeps a page that came out of sweeping empty in the pool, if there's room
+static void releasePage(Page* page) {
+  auto vm = VM::GetInstance();
+  if (page->cellSize <= MAX_CELL_SIZE && vm->emptyPageCount < EMPTY_PAGES_MAX) {
+    pushPage(&vm->emptyPages, page);
+    vm->emptyPageCount++;
+  } else {
+    free(page);
+  }
+}
+
+/**
+ * Makes page the one sizeClass allocates from, linking its free cells into
+ * freeCells. They're linked back to front, so they get handed out in address
+ * order.
+ */
+static void useFreeCells(SizeClass* sizeClass, Page* page) {
+  FreeCell* freeCells = NULL;
+  for (uint32_t cell = page->cellCount; cell-- > 0;) {
+    Obj* object = cellAt(page, cell);
+    if (testBit(page->live, granuleOf(object))) continue;
+    ((FreeCell*)object)->next = freeCells;
+    freeCells = (FreeCell*)object;
+  }
+  sizeClass->current = page;
+  sizeClass->freeCells = freeCells;
+}
+
+/**
+ * Frees every cell on page whose object didn't get marked, and clears the
+ * marks for the next collection. The only dead objects it touches are the
+ * ones that own memory outside the heap.
+ */
+static void sweepPage(Page* page) {
+  auto vm = VM::GetInstance();
+  size_t before = vm->bytesAllocated;
+  size_t freed = 0;
+  for (int i = 0; i < BITMAP_WORDS; i++) {
+    uint64_t dead = page->live[i] & ~page->marks[i];
+    page->marks[i] = 0;
+    if (dead == 0) continue;
+
+    for (uint64_t owners = dead & page->owners[i]; owners != 0; owners &= owners - 1) {
+      releaseOwned(objectAt(page, i * 64 + __builtin_ctzll(owners)));
+    }
+#if defined(DEBUG_LOG_GC) || defined(DEBUG_STRESS_GC)
+    for (uint64_t bits = dead; bits != 0; bits &= bits - 1) {
+      Obj* object = objectAt(page, i * 64 + __builtin_ctzll(bits));
+#ifdef DEBUG_LOG_GC
+      printf("%p free type %d\n\n", (void*)object, object->type);
+#endif
+#ifdef DEBUG_STRESS_GC
+      // Anything still pointing at a dead object should fall over right away
+      memset(object, 0xbd, page->cellSize);
+#endif
+    }
+#endif
+
+    page->live[i] &= ~dead;
+    page->owners[i] &= ~dead;
+    freed += __builtin_popcountll(dead);
+  }
+
+  page->liveCount -= freed;
+  vm->bytesAllocated -= freed * page->cellSize;
+  vm->gcStats.bytesFreed += before - vm->bytesAllocated;
+}
+
+// The next page for sizeClass to allocate from, sweeping one if it has to
+static Page* nextPage(SizeClass* sizeClass) {
+  Page* page = popPage(&sizeClass->swept);
+  if (page != NULL) return page;
+
+  auto vm = VM::GetInstance();
+  while ((page = popPage(&sizeClass->unswept)) != NULL) {
+    vm->unsweptPages--;
+    sweepPage(page);
+    if (page->liveCount < page->cellCount) return page;
+    pushPage(&sizeClass->full, page);
+  }
+  return newPage(sizeClass->cellSize);
+}
+
+/**
+ * Finds a cell in the old space for an object of size bytes, which is usually
+ * just popping the free list of its size class. Pages the last collection
+ * left unswept get swept here as the allocator comes to them, so most of a
+ * sweep happens in passing. This never collects, so it's safe to call in the
+ * middle of a collection, and it leaves the object unmarked.
+ */
+Obj* allocateCell(size_t size) {
+  auto vm = VM::GetInstance();
+  Page* page;
+  Obj* object;
+  if (size > MAX_CELL_SIZE) {
+    page = newPage(size);
+    pushPage(&vm->largePages, page);
+    object = cellAt(page, 0);
+  } else {
+    SizeClass* sizeClass = sizeClassOf(size);
+    if (sizeClass->freeCells == NULL) {
+      if (sizeClass->current != NULL) pushPage(&sizeClass->full, sizeClass->current);
+      useFreeCells(sizeClass, nextPage(sizeClass));
+    }
+    object = (Obj*)sizeClass->freeCells;
+    sizeClass->freeCells = sizeClass->freeCells->next;
+    page = sizeClass->current;
+#ifdef HEAP_STATS
+    sizeClass->allocations++;
+#endif
+  }
+
+  setBit(page->live, granuleOf(object));
+  page->liveCount++;
+  vm->bytesAllocated += page->cellSize;
+  return object;
+}
+
+/**
+ * Gives object's cell back right away, for an object nothing can have seen
+ * yet. It doesn't release anything the object owns. A cell on the page
+ * that's being allocated from goes straight back on the free list, and any
+ * other page gets its cell back when it's next swept.
+ */
+void freeCell(Obj* object) {
+  Page* page = pageOf(object);
+  size_t granule = granuleOf(object);
+  clearBit(page->live, granule);
+  clearBit(page->marks, granule);
+  clearBit(page->owners, granule);
+  page->liveCount--;
+  VM::GetInstance()->bytesAllocated -= page->cellSize;
+
+  if (page->cellSize > MAX_CELL_SIZE) return;
+  SizeClass* sizeClass = sizeClassOf(page->cellSize);
+  if (sizeClass->current == page) {
+    ((FreeCell*)object)->next = sizeClass->freeCells;
+    sizeClass->freeCells = (FreeCell*)object;
+  }
+}
+
+// See ownsMemory()
+void markOwner(Obj* object) {
+  setBit(pageOf(object)->owners, granuleOf(object));
+}
+
+static size_t moveAll(Page** from, Page** to) {
+  size_t count = 0;
+  while (*from != NULL) {
+    pushPage(to, popPage(from));
+    count++;
+  }
+  return count;
+}
+
+/**
+ * Sets every page aside to be swept, once marking is done. Each keeps its
+ * marks until it gets swept, by allocateCell() or by sweep(), and in the
+ * meantime none of its cells get handed out.
+ */
+void startSweeping() {
+  auto vm = VM::GetInstance();
+  vm->unsweptPages = 0;
+  for (SizeClass& sizeClass : vm->sizeClasses) {
+    if (sizeClass.current != NULL) {
+      pushPage(&sizeClass.unswept, sizeClass.current);
+      sizeClass.current = NULL;
+      sizeClass.freeCells = NULL;
+      vm->unsweptPages++;
+    }
+    vm->unsweptPages += moveAll(&sizeClass.swept, &sizeClass.unswept);
+    vm->unsweptPages += moveAll(&sizeClass.full, &sizeClass.unswept);
+  }
+  vm->unsweptPages += moveAll(&vm->largePages, &vm->unsweptLarge);
+}
+
+/**
+ * Sweeps whatever pages allocateCell() hasn't got to, until it's done about
+ * work objects' worth (see PAGE_SWEEP_WORK). Pages that come out empty go
+ * to the empty page pool or back to the system, so freeing a whole page of
+ * garbage doesn't cost anything per object.
+ * @return true once every page has been swept
+ */
+bool sweep(size_t work) {
+  auto vm = VM::GetInstance();
+  int next = 0;
+  while (vm->unsweptPages > 0 && work > 0) {
+    work -= std::min(work, (size_t)PAGE_SWEEP_WORK);
+    vm->unsweptPages--;
+
+    Page* page = popPage(&vm->unsweptLarge);
+    if (page != NULL) {
+      sweepPage(page);
+      if (page->liveCount == 0) {
+        releasePage(page);
+      } else {
+        pushPage(&vm->largePages, page);
+      }
+      continue;
+    }
+
+    while (vm->sizeClasses[next].unswept == NULL) next++;
+    SizeClass* sizeClass = &vm->sizeClasses[next];
+    page = popPage(&sizeClass->unswept);
+    sweepPage(page);
+    if (page->liveCount == 0) {
+      releasePage(page);
+    } else if (page->liveCount == page->cellCount) {
+      pushPage(&sizeClass->full, page);
+    } else {
+      pushPage(&sizeClass->swept, page);
+    }
+  }
+  return vm->unsweptPages == 0;
+}
+
+static void forEachInList(Page* page, void (*fn)(Obj* object)) {
+  for (; page != NULL; page = page->next) {
+    for (int i = 0; i < BITMAP_WORDS; i++) {
+      for (uint64_t bits = page->live[i]; bits != 0; bits &= bits - 1) {
+        fn(objectAt(page, i * 64 + __builtin_ctzll(bits)));
+      }
+    }
+  }
+}
+
+/**
+ * Calls fn on every object in the old space, including dead ones on pages
+ * that haven't been swept yet.
+ */
+void forEachOldObject(void (*fn)(Obj* object)) {
+  auto vm = VM::GetInstance();
+  for (SizeClass& sizeClass : vm->sizeClasses) {
+    forEachInList(sizeClass.current, fn);
+    forEachInList(sizeClass.swept, fn);
+    forEachInList(sizeClass.unswept, fn);
+    forEachInList(sizeClass.full, fn);
+  }
+  forEachInList(vm->largePages, fn);
+  forEachInList(vm->unsweptLarge, fn);
+}
+
+static void freeList(Page** list) {
+  while (*list != NULL) {
+    Page* page = popPage(list);
+    for (int i = 0; i < BITMAP_WORDS; i++) {
+      for (uint64_t owners = page->live[i] & page->owners[i]; owners != 0; owners &= owners - 1) {
+        releaseOwned(objectAt(page, i * 64 + __builtin_ctzll(owners)));
+      }
+    }
+    free(page);
+  }
+}
+
+// Frees the whole old space, when the VM goes away
+void freePages() {
+  auto vm = VM::GetInstance();
+  for (SizeClass& sizeClass : vm->sizeClasses) {
+    if (sizeClass.current != NULL) {
+      pushPage(&sizeClass.full, sizeClass.current);
+      sizeClass.current = NULL;
+      sizeClass.freeCells = NULL;
+    }
+    freeList(&sizeClass.swept);
+    freeList(&sizeClass.unswept);
+    freeList(&sizeClass.full);
+  }
+  freeList(&vm->largePages);
+  freeList(&vm->unsweptLarge);
+  freeList(&vm->emptyPages);
+  vm->unsweptPages = 0;
+  vm->emptyPageCount = 0;
+}
+
+#ifdef HEAP_STATS
+static void countPages(Page* page, size_t* pages, size_t* live, size_t* cells) {
+  for (; page != NULL; page = page->next) {
+    (*pages)++;
+    *live += page->liveCount;
+    *cells += page->cellCount;
+  }
+}
+
+/**
+ * How many pages each size class has, and how many of their cells hold
+ * objects and how many are free. Cells on pages that haven't been swept yet
+ * count as live until they are.
+ */
+void printHeapStats() {
+  auto vm = VM::GetInstance();
+  printf("%6s %8s %8s %10s %10s %12s\n", "cell", "pages", "bytes", "live", "free", "allocations");
+  for (SizeClass& sizeClass : vm->sizeClasses) {
+    size_t pages = 0, live = 0, cells = 0;
+    countPages(sizeClass.current, &pages, &live, &cells);
+    countPages(sizeClass.swept, &pages, &live, &cells);
+    countPages(sizeClass.unswept, &pages, &live, &cells);
+    countPages(sizeClass.full, &pages, &live, &cells);
+    if (pages == 0 && sizeClass.allocations == 0) continue;
+    printf("%6u %8zu %8zu %10zu %10zu %12zu\n", sizeClass.cellSize, pages,
+           pages * HEAP_PAGE_SIZE, live, cells - live, sizeClass.allocations);
+  }
+
+  size_t pages = 0, live = 0, cells = 0;
+  countPages(vm->largePages, &pages, &live, &cells);
+  countPages(vm->unsweptLarge, &pages, &live, &cells);
+  printf("%6s %8zu %8s %10zu\n", "large", pages, "", live);
+  printf("%6s %8zu\n", "empty", vm->emptyPageCount);
+}
+#endif
@@ -0,0 +1,107 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include <cstddef>
+
+/**
+ * The old space is made of pages of HEAP_PAGE_SIZE bytes, aligned to
+ * HEAP_PAGE_SIZE, so the page an object is on is just its address with the
+ * low bits masked off. Each page is split into cells of one size class. A
+ * page keeps one bit per GRANULE_SIZE bytes in each of its bitmaps, of which
+ * only the bit for a cell's first granule is used:
+ *
+ *   live    the cell holds an object
+ *   marks   the object was marked by the major collection in progress
+ *   owners  the object owns memory outside the heap, see releaseOwned()
+ *
+ * Sweeping a page is then a few word-wide operations on its bitmaps, and the
+ * only dead objects it has to touch are the owners.
+ */
+#define HEAP_PAGE_SIZE (32 * 1024)
+#define GRANULE_SIZE 16
+#define PAGE_GRANULES (HEAP_PAGE_SIZE / GRANULE_SIZE)
+#define BITMAP_WORDS (PAGE_GRANULES / 64)
+
+// The biggest cell there is. Bigger objects get a large page to themselves.
+#define MAX_CELL_SIZE 2048
+#define SIZE_CLASS_COUNT 24
+
+// Sweeping a page counts as this many objects of a collection's work
+#define PAGE_SWEEP_WORK 16
+
+// How many empty pages to hang on to for reuse rather than free
+#define EMPTY_PAGES_MAX 64
+
+struct Obj;
+
+typedef struct Page {
+  struct Page* next;
+  uint32_t cellSize;
+  uint32_t cellCount;
+  uint32_t liveCount;
+  uint64_t live[BITMAP_WORDS];
+  uint64_t marks[BITMAP_WORDS];
+  uint64_t owners[BITMAP_WORDS];
+} Page;
+
+// Where the first cell starts, right after the header
+#define FIRST_CELL ((sizeof(Page) + GRANULE_SIZE - 1) & ~(size_t)(GRANULE_SIZE - 1))
+
+// A cell on the free list, see SizeClass
+typedef struct FreeCell {
+  struct FreeCell* next;
+} FreeCell;
+
+/**
+ * The pages of one size class. allocateCell() pops cells off freeCells,
+ * which links together the free cells of current. When those run out it
+ * moves on to one of the swept pages, and only sweeps a page from unswept
+ * when there aren't any. Pages that filled up wait in full until the next
+ * collection.
+ */
+typedef struct {
+  uint32_t cellSize;
+  FreeCell* freeCells;
+  Page* current;
+  Page* swept;
+  Page* unswept;
+  Page* full;
+#ifdef HEAP_STATS
+  size_t allocations;
+#endif
+} SizeClass;
+
+static inline Page* pageOf(Obj* object) {
+  return (Page*)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t granuleOf(Obj* object) {
+  return ((uintptr_t)object & (HEAP_PAGE_SIZE - 1)) / GRANULE_SIZE;
+}
+
+static inline bool testBit(const uint64_t* bits, size_t index) {
+  return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void setBit(uint64_t* bits, size_t index) {
+  bits[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static inline void clearBit(uint64_t* bits, size_t index) {
+  bits[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+void initSizeClasses(SizeClass* classes);
+Obj* allocateCell(size_t size);
+void freeCell(Obj* object);
+void markOwner(Obj* object);
+void startSweeping();
+bool sweep(size_t work);
+void forEachOldObject(void (*fn)(Obj* object));
+void freePages();
+#ifdef HEAP_STATS
+void printHeapStats();
+#endif
+
+#endif
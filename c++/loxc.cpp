@@ -0,0 +1,272 @@
+#include "loxc.h"
+#include "chunk.h"
+#include "file.h"
+#include "hash.h"
+#include "vm.h"
+#include <cstdio>
+#include <vector>
+
+#define LOXC_HEADER_SIZE 20
+// Length of the name string for a function without one
+#define LOXC_NO_NAME 0xffffffffu
+
+class LoxcWriter {
+public:
+  std::vector<uint8_t> bytes;
+
+  void u8(uint8_t value) {
+    bytes.push_back(value);
+  }
+
+  void u32(uint32_t value) {
+    for (int i = 0; i < 4; i++) bytes.push_back((value >> (8 * i)) & 0xff);
+  }
+
+  void u64(uint64_t value) {
+    u32((uint32_t)value);
+    u32((uint32_t)(value >> 32));
+  }
+
+  void string(const char* chars, int length) {
+    u32(length);
+    bytes.insert(bytes.end(), chars, chars + length);
+  }
+
+  // Only what the compiler puts in a constant table can be written
+  bool value(Value value) {
+    if (IS_NIL(value)) {
+      u8(LOXC_NIL);
+    } else if (IS_BOOL(value)) {
+      u8(AS_BOOL(value) ? LOXC_TRUE : LOXC_FALSE);
+    } else if (IS_NUMBER(value)) {
+      double number = AS_NUMBER(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      u8(LOXC_NUMBER);
+      u64(bits);
+    } else if (IS_STRING(value)) {
+      u8(LOXC_STRING);
+      string(AS_STRING(value)->chars, AS_STRING(value)->length);
+    } else if (IS_FUNCTION(value)) {
+      u8(LOXC_FUNCTION);
+      return function(AS_FUNCTION(value));
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool function(ObjFunction* function) {
+    u32(function->arity);
+    u32(function->upvalueCount);
+    u32(function->maxStackDepth);
+    if (function->name == NULL) {
+      u32(LOXC_NO_NAME);
+    } else {
+      string(function->name->chars, function->name->length);
+    }
+
+    Chunk& chunk = function->chunk;
+    u32(chunk.code.size());
+    bytes.insert(bytes.end(), chunk.code.begin(), chunk.code.end());
+
+    CountedVector<LineStart>& lines = chunk.getLineStarts();
+    u32(lines.size());
+    for (const LineStart& start : lines) {
+      u32(start.offset);
+      u32(start.line);
+    }
+
+    // The caches start out empty, only what they're for is saved
+    u32(chunk.caches.size());
+    for (const InlineCache& cache : chunk.caches) {
+      u8(cache.instruction);
+      u32(cache.line);
+    }
+
+    u32(chunk.constants.size());
+    for (Value constant : chunk.constants) {
+      if (!value(constant)) return false;
+    }
+    return true;
+  }
+};
+
+/**
+ * Decodes a function tree from a buffer holding the whole file. Running past
+ * the end of the buffer sets failed and makes every later read return 0, so
+ * the callers only have to check once at the end.
+ */
+class LoxcReader {
+public:
+  const uint8_t* at;
+  const uint8_t* end;
+  bool failed;
+
+  LoxcReader(const uint8_t* start, const uint8_t* end)
+      : at(start), end(end), failed(false) {}
+
+  bool has(size_t count) {
+    if ((size_t)(end - at) < count) failed = true;
+    return !failed;
+  }
+
+  uint8_t u8() {
+    if (!has(1)) return 0;
+    return *at++;
+  }
+
+  uint32_t u32() {
+    if (!has(4)) return 0;
+    uint32_t value = at[0] | (at[1] << 8) | (at[2] << 16) | ((uint32_t)at[3] << 24);
+    at += 4;
+    return value;
+  }
+
+  uint64_t u64() {
+    uint64_t low = u32();
+    return low | ((uint64_t)u32() << 32);
+  }
+
+  ObjString* string(uint32_t length) {
+    if (!has(length)) return NULL;
+    ObjString* string = copyString((const char*)at, length);
+    at += length;
+    return string;
+  }
+
+  // Reads one constant into the end of function's constant table
+  void constant(ObjFunction* function) {
+    CountedVector<Value>& constants = function->chunk.constants;
+    switch (u8()) {
+      case LOXC_NIL: constants.push_back(NIL_VAL); break;
+      case LOXC_FALSE: constants.push_back(BOOL_VAL(false)); break;
+      case LOXC_TRUE: constants.push_back(BOOL_VAL(true)); break;
+      case LOXC_NUMBER: {
+        uint64_t bits = u64();
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        constants.push_back(NUMBER_VAL(number));
+        break;
+      }
+      case LOXC_STRING: {
+        ObjString* string = this->string(u32());
+        if (string != NULL) constants.push_back(OBJ_VAL(string));
+        break;
+      }
+      case LOXC_FUNCTION: {
+        ObjFunction* nested = this->function();
+        if (nested != NULL) constants.push_back(OBJ_VAL(nested));
+        break;
+      }
+      default:
+        failed = true;
+        break;
+    }
+  }
+
+  ObjFunction* function() {
+    // Everything allocated below is reachable from function, so keeping it
+    // on the stack keeps the GC off all of it
+    VM* vm = VM::GetInstance();
+    ObjFunction* function = newFunction();
+    vm->push(OBJ_VAL(function));
+
+    function->arity = u32();
+    function->upvalueCount = u32();
+    function->maxStackDepth = u32();
+    uint32_t nameLength = u32();
+    if (nameLength != LOXC_NO_NAME) function->name = string(nameLength);
+
+    Chunk& chunk = function->chunk;
+    uint32_t codeCount = u32();
+    if (has(codeCount)) {
+      chunk.code.assign(at, at + codeCount);
+      at += codeCount;
+    }
+
+    uint32_t lineCount = u32();
+    if (has((size_t)lineCount * 8)) {
+      CountedVector<LineStart>& lines = chunk.getLineStarts();
+      for (uint32_t i = 0; i < lineCount; i++) {
+        int offset = u32();
+        lines.push_back({offset, (int)u32()});
+      }
+    }
+
+    uint32_t cacheCount = u32();
+    if (has((size_t)cacheCount * 5)) {
+      for (uint32_t i = 0; i < cacheCount; i++) {
+        InlineCache cache = {};
+        cache.instruction = u8();
+        cache.line = u32();
+        chunk.caches.push_back(cache);
+      }
+    }
+
+    // Every constant takes at least its tag byte
+    uint32_t constantCount = u32();
+    if (has(constantCount)) {
+      for (uint32_t i = 0; i < constantCount && !failed; i++) constant(function);
+    }
+
+    vm->pop();
+    return failed ? NULL : function;
+  }
+};
+
+/**
+ * Writes script and everything it contains to path. It goes to a temporary
+ * file first and gets renamed into place, so a reader never sees half a file.
+ */
+bool writeLoxc(ObjFunction* script, const std::string& path) {
+  LoxcWriter payload;
+  if (!payload.function(script)) return false;
+
+  LoxcWriter header;
+  header.bytes = {'L', 'O', 'X', 'C'};
+  header.u32(LOXC_VERSION);
+  header.u32(OPCODE_COUNT);
+  header.u32(payload.bytes.size());
+  header.u32(hashWordwise((const char*)payload.bytes.data(), payload.bytes.size()));
+
+  std::string temporary = path + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if (file == NULL) return false;
+  bool written =
+      fwrite(header.bytes.data(), 1, header.bytes.size(), file) == header.bytes.size() &&
+      fwrite(payload.bytes.data(), 1, payload.bytes.size(), file) == payload.bytes.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+    remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+static ObjFunction* decodeLoxc(const uint8_t* data, size_t size) {
+  if (size < LOXC_HEADER_SIZE || memcmp(data, "LOXC", 4) != 0) return NULL;
+
+  LoxcReader reader(data + 4, data + size);
+  if (reader.u32() != LOXC_VERSION || reader.u32() != OPCODE_COUNT) return NULL;
+  uint32_t length = reader.u32();
+  uint32_t checksum = reader.u32();
+  if (length != size - LOXC_HEADER_SIZE ||
+      hashWordwise((const char*)reader.at, length) != checksum) {
+    return NULL;
+  }
+
+  ObjFunction* script = reader.function();
+  return reader.failed || reader.at != reader.end ? NULL : script;
+}
+
+/**
+ * Loads the script in the .loxc file at path. Returns NULL if there's no such
+ * file or it's for a different version, damaged or truncated, in which case
+ * the caller should compile the source instead.
+ */
+ObjFunction* readLoxc(const std::string& path) {
+  MappedFile file(path);
+  if (!file.isOpen()) return NULL;
+  return decodeLoxc(file.bytes(), file.size());
+}
@@ -0,0 +1,45 @@
+#ifndef clox_loxc_h
+#define clox_loxc_h
+
+#include "common.h"
+#include "object.h"
+#include <string>
+
+/**
+ * .loxc files hold a compiled script, so running it again can skip the
+ * compiler. The file is a fixed header followed by the script's function
+ * tree, depth first, with every integer little endian:
+ *
+ *   header    "LOXC", version u32, OPCODE_COUNT u32, payload bytes u32,
+ *             hashWordwise() of the payload u32
+ *   function  arity u32, upvalueCount u32, maxStackDepth u32, name string
+ *             (0xffffffff length for the script), code u32 count + bytes,
+ *             line runs u32 count + (offset u32, line u32) each, inline caches
+ *             u32 count + (instruction u8, line u32) each, constants u32
+ *             count + values
+ *   value     a LoxcTag byte, then 8 bytes for a number, a string, or a
+ *             whole nested function
+ *   string    length u32 + bytes
+ *
+ * Upvalue descriptors are OP_CLOSURE operands, so they're part of the code.
+ * The loader only reads from one buffer holding the whole file, which it maps
+ * into memory instead of reading, and checks the checksum before decoding
+ * anything.
+ */
+
+// Bump whenever the format or what the VM expects of the bytecode changes
+#define LOXC_VERSION 1
+
+typedef enum {
+  LOXC_NIL,
+  LOXC_FALSE,
+  LOXC_TRUE,
+  LOXC_NUMBER,
+  LOXC_STRING,
+  LOXC_FUNCTION,
+} LoxcTag;
+
+bool writeLoxc(ObjFunction* script, const std::string& path);
+ObjFunction* readLoxc(const std::string& path);
+
+#endif
@@ -1,12 +1,18 @@
 #include "chunk.h"
+#include "compiler.h"
+#include "file.h"
+#include "loxc.h"
 #include "vm.h"
 #include <iostream>
-#include <string>
-#include <fstream>
 #include <sstream>
+#include <string>
+#include <filesystem>
 #include <time.h>
 
-static Value clockNative(int argCount, std::vector<Value>& args) {
+// Set by --gc-stats
+static bool gcStats = false;
+
+static Value clockNative(int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
@@ -25,6 +31,7 @@ VM *VM::GetInstance()
   {
     vm_ = new VM();
 
+    vm_->initString = copyString("init", 4);
     vm_->defineNative("clock", clockNative);
   }
   return vm_;
@@ -42,30 +49,169 @@ static void repl(VM* vm) {
   }
 }
 
-static std::string readFile(const std::string& path) {
-  std::ifstream fileStream(path);
-  std::stringstream buffer;
-  buffer << fileStream.rdbuf();
-  return buffer.str();
+// Where the compiled form of the script at path goes
+static std::string loxcPath(const std::string& path) {
+  return std::filesystem::path(path).replace_extension(".loxc").string();
+}
+
+/**
+ * The script at path from its .loxc, if there is one that's newer than the
+ * source and loads cleanly. Register code isn't cached, so --registers always
+ * compiles the source.
+ */
+static ObjFunction* loadCached(VM* vm, const std::string& path) {
+  if (vm->useRegisters) return NULL;
+
+  std::error_code error;
+  std::string cached = loxcPath(path);
+  auto cachedTime = std::filesystem::last_write_time(cached, error);
+  if (error) return NULL;
+  auto sourceTime = std::filesystem::last_write_time(path, error);
+  if (error || cachedTime <= sourceTime) return NULL;
+  return readLoxc(cached);
+}
+
+static void requireOpen(const MappedFile& source, const std::string& path) {
+  if (!source.isOpen()) {
+    std::fprintf(stderr, "Could not open file \"%s\".\n", path.c_str());
+    exit(74);
+  }
+}
+
+// Compiles the script at path into its .loxc without running it
+static void emitLoxc(const std::string& path) {
+  MappedFile source(path);
+  requireOpen(source, path);
+  Chunk chunk;
+  ObjFunction* script = compile(source.text(), chunk);
+  if (script == NULL) exit(65);
+
+  std::string cached = loxcPath(path);
+  if (!writeLoxc(script, cached)) {
+    std::fprintf(stderr, "Could not write \"%s\".\n", cached.c_str());
+    exit(74);
+  }
 }
 
 static void runFile(VM* vm, const std::string& path) {
-  std::string source = readFile(path);
-  InterpretResult result = vm->interpret(source);
+  InterpretResult result;
+  ObjFunction* script = loadCached(vm, path);
+  if (script != NULL) {
+    result = vm->interpret(script);
+  } else {
+    // The scanner reads straight out of the mapping, which stays put until
+    // the script is done
+    MappedFile source(path);
+    requireOpen(source, path);
+    result = vm->interpret(source.text());
+  }
+  if (gcStats) printGCStats();
+#ifdef INLINE_CACHE_STATS
+  vm->printCacheStats();
+#endif
+#ifdef PROFILE_OPCODES
+  vm->printOpcodeProfile();
+#endif
+#ifdef GC_PAUSE_STATS
+  printPauseStats();
+#endif
+#ifdef HEAP_STATS
+  printHeapStats();
+#endif
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// A number of bytes, which can end in K, M or G
+static size_t parseSize(const char* text) {
+  char* end;
+  double size = std::strtod(text, &end);
+  switch (*end) {
+    case 'G': case 'g': size *= 1024; [[fallthrough]];
+    case 'M': case 'm': size *= 1024; [[fallthrough]];
+    case 'K': case 'k': size *= 1024;
+  }
+  return (size_t)size;
+}
+
+/**
+ * Applies one of the options that tune the collector, which take a value
+ * unless it's --gc-stats. Returns false if option isn't one of them, or is
+ * missing its value.
+ */
+static bool gcOption(VM* vm, const std::string& option, const char* value) {
+  if (option == "--gc-stats") {
+    gcStats = true;
+    return true;
+  }
+  if (value == NULL) return false;
+
+  if (option == "--gc-step") {
+    vm->gcStepWork = std::strtoul(value, NULL, 10);
+  } else if (option == "--gc-pause") {
+    vm->gcMaxPause = std::strtod(value, NULL);
+  } else if (option == "--gc-heap") {
+    vm->nextGC = parseSize(value);
+  } else if (option == "--gc-growth") {
+    vm->gcGrowFactor = std::strtod(value, NULL);
+  } else if (option == "--gc-min") {
+    vm->gcMinInterval = parseSize(value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// The same collector options as the command line, from LOX_GC, which the
+// command line overrides
+static void gcEnvironment(VM* vm) {
+  const char* environment = std::getenv("LOX_GC");
+  if (environment == NULL) return;
+
+  std::istringstream words(environment);
+  std::string option, value;
+  while (words >> option) {
+    bool hasValue = option != "--gc-stats" && (words >> value);
+    if (!gcOption(vm, option, hasValue ? value.c_str() : NULL)) {
+      std::fprintf(stderr, "Unknown option \"%s\" in LOX_GC.\n", option.c_str());
+      exit(64);
+    }
+  }
+}
+
 int main(int argc, const char* argv[]) {
   auto vm = VM::GetInstance();
+  gcEnvironment(vm);
 
-  if (argc == 1) {
+  int arg = 1;
+  bool emit = false;
+  for (; arg < argc && std::string(argv[arg]).rfind("--", 0) == 0; arg++) {
+    std::string option = argv[arg];
+    const char* value = option != "--gc-stats" && arg + 1 < argc ? argv[arg + 1] : NULL;
+    if (option == "--registers") {
+      vm->useRegisters = true;
+    } else if (option == "--emit-loxc") {
+      emit = true;
+    } else if (gcOption(vm, option, value)) {
+      if (value != NULL) arg++;
+    } else {
+      arg = argc + 1;
+    }
+  }
+
+  if (arg == argc && !emit) {
     repl(vm);
-  } else if (argc == 2) {
-    runFile(vm, argv[1]);
+  } else if (arg == argc - 1) {
+    if (emit) {
+      emitLoxc(argv[arg]);
+    } else {
+      runFile(vm, argv[arg]);
+    }
   } else {
-    std::fprintf(stderr, "Usage: clox [path]\n");
+    std::fprintf(stderr, "Usage: clox [--registers] [--emit-loxc] [--gc-step objects] "
+                         "[--gc-pause microseconds] [--gc-heap bytes] [--gc-growth factor] "
+                         "[--gc-min bytes] [--gc-stats] [path]\n");
     exit(64);
   }
 
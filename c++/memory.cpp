@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <algorithm>
+#include <chrono>
 
 #include "compiler.h"
 #include "object.h"
@@ -10,18 +12,54 @@
 #include "chunk.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// Every object in the nursery starts on an 8 byte boundary
+#define ALIGN_OBJECT(size) (((size) + 7) & ~(size_t)7)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
+// How many objects an increment traces or sweeps between checking the clock
+#define PAUSE_CHECK_INTERVAL 64
+
+#ifdef DEBUG_LOG_GC
+static size_t bytesBeforeGC;
+#endif
+
+#ifdef GC_PAUSE_STATS
+// In microseconds, see printPauseStats()
+static std::vector<double> minorPauses;
+static std::vector<double> majorPauses;
 #endif
 
+static double microsecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Gives the major collector its next step, when there's a collection going or
+ * the old space has grown past nextGC.
+ */
+static void collectIfDue() {
+#ifdef DEBUG_STRESS_GC
+  collectStep();
+#else
   auto vm = VM::GetInstance();
-  if (vm->bytesAllocated > vm->nextGC)
-    collectGarbage();
-  }
+  if (vm->gcPhase != GC_IDLE || vm->bytesAllocated > vm->nextGC) collectStep();
+#endif
+}
+
+/**
+ * Counts the old space's bytes as they come and go, which is what starts a
+ * major collection. That's every object in it, whatever the objects own
+ * through reallocate(), and their containers' memory through
+ * CountingAllocator. The nursery is a fixed size, so young objects aren't
+ * counted until they're promoted, and neither is the overflow of a young
+ * instance, see countYoungOwned().
+ */
+void countBytes(size_t oldSize, size_t newSize) {
+  VM::GetInstance()->bytesAllocated += newSize - oldSize;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  countBytes(oldSize, newSize);
+  if (newSize > oldSize) collectIfDue();
 
   if (newSize == 0) {
     free(pointer);
@@ -33,103 +71,511 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC  
-  printf("%p free type %d\n\n", (void*)object, object->type);
-#endif
+// An object in the old space, see allocateCell()
+Obj* allocateOld(size_t size) {
+  collectIfDue();
+  return allocateCell(size);
+}
+
+/**
+ * Counts what a young owner holds outside the nursery, as it leaves it.
+ * addField() keeps a young instance's overflow out of bytesAllocated, so a
+ * promoted instance brings it into the old space's count, and a dead one
+ * has it counted back for releaseOwned() to take off again. Instances are
+ * the only owners that start out young.
+ */
+static void countYoungOwned(Obj* object) {
+  if (object->type == OBJ_INSTANCE) {
+    countBytes(0, sizeof(Value) * ((ObjInstance*)object)->overflowCapacity);
+  }
+}
+
+/**
+ * Frees the memory object owns outside the heap, once it's dead. The sweep
+ * only calls this for objects with their owners bit set, and the minor
+ * collection for the ones in youngOwners. See ownsMemory().
+ */
+void releaseOwned(Obj* object) {
   switch (object->type) {
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      FREE_ARRAY(ObjClosure*, klass->methods, klass->methodCount);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      function->chunk.freeChunk();
+      function->registerChunk.freeChunk();
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      FREE_ARRAY(Value, instance->overflow, instance->overflowCapacity);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      shape->slots.freeTable();
+      shape->transitions.freeTable();
+      break;
+    }
     case OBJ_BOUND_METHOD:
-      FREE(ObjBoundMethod, object);
+    case OBJ_CLOSURE:
+    case OBJ_NATIVE:
+    case OBJ_ROPE:
+    case OBJ_STRING:
+    case OBJ_UPVALUE:
       break;
+  }
+}
+
+/**
+ * Garbage Collector for the VM, frees the whole old space and whatever young
+ * objects own outside the nursery
+ */
+void freeObjects() {
+  auto vm = VM::GetInstance();
+  freePages();
+
+  for (Obj* young : vm->youngOwners) {
+    countYoungOwned(young);
+    if (young->next == NULL) releaseOwned(young);
+  }
+  vm->youngOwners.clear();
+}
+
+/**
+ * How many bytes object takes up, counting whatever is stored inline after
+ * the header.
+ */
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_CLASS: return sizeof(ObjClass);
+    case OBJ_CLOSURE:
+      return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inlineCount;
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_ROPE: return sizeof(ObjRope);
+    case OBJ_SHAPE: return sizeof(ObjShape);
+    case OBJ_STRING: return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+
+/**
+ * Bump allocates size bytes in the nursery, or returns NULL if they don't
+ * fit. Running out doesn't collect here, since a minor collection moves
+ * objects and the caller may be holding some. It just flags one for the next
+ * safepoint, and until then everything goes into the old space.
+ */
+Obj* allocateYoung(size_t size) {
+  if (size > NURSERY_MAX_OBJECT) return NULL;
+
+  auto vm = VM::GetInstance();
+  size = ALIGN_OBJECT(size);
+  if (size > (size_t)(vm->nurseryEnd - vm->nurseryTop)) {
+    vm->nurseryFull = true;
+    return NULL;
+  }
+
+  Obj* object = (Obj*)vm->nurseryTop;
+  vm->nurseryTop += size;
+  return object;
+}
+
+// Hands object back to the nursery if nothing was allocated after it
+void freeLastYoung(Obj* object, size_t size) {
+  auto vm = VM::GetInstance();
+  if ((uint8_t*)object + ALIGN_OBJECT(size) == vm->nurseryTop) {
+    vm->nurseryTop = (uint8_t*)object;
+  }
+}
+
+void rememberObject(Obj* object) {
+  object->isRemembered = true;
+  VM::GetInstance()->rememberedSet.push_back(object);
+}
+
+/**
+ * Notes that object just took ownership of memory outside the heap, which
+ * has to be freed when it dies. Old objects get their owners bit set, so
+ * sweeping doesn't have to look at any other dead objects.
+ */
+void ownsMemory(Obj* object) {
+  auto vm = VM::GetInstance();
+  if (vm->isYoung(object)) {
+    vm->youngOwners.push_back(object);
+  } else {
+    markOwner(object);
+  }
+}
+
+/**
+ * Copies a young object into the old space, once, leaving the address of the
+ * copy behind in the original's next. The copy gets scanned later, so the
+ * collection goes breadth first without recursing. This runs in the middle of
+ * a collection, so it can't go through reallocate().
+ */
+static Obj* promote(Obj* object) {
+  if (object->next != NULL) return object->next;
+
+  auto vm = VM::GetInstance();
+  size_t size = objectSize(object);
+  Obj* copy = allocateCell(size);
+  memcpy(copy, object, size);
+  vm->gcStats.bytesPromoted += ALIGN_OBJECT(size);
+  // Old objects keep their mark in their page
+  copy->isMarked = false;
+  if (object->isMarked) vm->setMarked(copy);
+
+  // A closed upvalue points at its own closed field
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    if (upvalue->location == &upvalue->closed) {
+      ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+    }
+  }
+
+  copy->next = NULL;
+  object->next = copy;
+  vm->promotedStack.push_back(copy);
+  return copy;
+}
+
+template <typename T>
+static inline void forwardObject(T*& object) {
+  if (object != NULL && VM::GetInstance()->isYoung((Obj*)object)) {
+    object = (T*)promote((Obj*)object);
+  }
+}
+
+static inline void forwardValue(Value& value) {
+  if (IS_OBJ(value) && VM::GetInstance()->isYoung(AS_OBJ(value))) {
+    value = OBJ_VAL(promote(AS_OBJ(value)));
+  }
+}
+
+static void forwardTable(HashTable& table) {
+  Entry* entries = table.getEntries();
+  for (int i = 0; i < table.getCapacity(); i++) {
+    forwardObject(entries[i].key);
+    forwardValue(entries[i].value);
+  }
+}
+
+/**
+ * Points every reference object holds to a young object at that object's
+ * old copy, promoting it first if that hasn't happened yet. The minor
+ * collection's version of blackenObject().
+ */
+static void forwardReferences(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      forwardValue(bound->receiver);
+      forwardObject(bound->method);
+      break;
+    }
     case OBJ_CLASS: {
-      FREE(ObjClass, object);
+      ObjClass* klass = (ObjClass*)object;
+      forwardObject(klass->name);
+      for (int i = 0; i < klass->methodCount; i++) {
+        forwardObject(klass->methods[i]);
+      }
+      forwardObject(klass->shape);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      // TODO: not sure I did this freeing right. Also I really shouldn't be
-      // explicitly freeing things in this program
+      forwardObject(closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        FREE(ObjUpvalue, closure->upvalues[i]);
+        forwardObject(closure->upvalues[i]);
       }
-      
-      FREE(ObjClosure, object) ;
       break;
     }
-    case OBJ_STRING: {
-      ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      forwardObject(function->name);
+      for (Value& constant : function->chunk.constants) forwardValue(constant);
+      for (Value& constant : function->registerChunk.constants) forwardValue(constant);
+      for (InlineCache& cache : function->chunk.caches) {
+        for (int i = 0; i < cache.count; i++) {
+          forwardObject(cache.entries[i].shape);
+          forwardObject(cache.entries[i].method);
+          forwardObject(cache.entries[i].transition);
+        }
+      }
       break;
     }
-    case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
-      break;
-    case OBJ_NATIVE: {
-      FREE(ObjNative, object);
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      forwardObject(instance->klass);
+      forwardObject(instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        forwardValue(*fieldSlot(instance, i));
+      }
       break;
     }
-    case OBJ_FUNCTION: {
-      ObjFunction* function = (ObjFunction*)object;
-      function->chunk.freeChunk();
-      FREE(ObjFunction, object);
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      forwardObject(rope->left);
+      forwardObject(rope->right);
+      forwardObject(rope->flat);
       break;
     }
-    case OBJ_INSTANCE: {
-      FREE(ObjInstance, object);
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      forwardTable(shape->slots);
+      forwardTable(shape->transitions);
       break;
     }
+    case OBJ_UPVALUE:
+      forwardValue(((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
   }
 }
 
 /**
- * Garbage Collector for the VM, just walks the object linked list and frees
- * all of the objects
+ * A minor collection: copies every young object that's still reachable into
+ * the old space and empties the nursery. Only the roots and the remembered
+ * set get scanned, not the old space, so the cost is in what survives rather
+ * than in how big the heap is.
+ *
+ * Objects move, so this can only run at a safepoint in the VM (see
+ * SAFEPOINT() in vm.cpp), where everything live is reachable from the VM's
+ * own roots and no C++ code is holding on to an object.
+ *
+ * It can run in the middle of a major collection's marking, which is fine as
+ * long as gray young objects stay gray once they're copied.
  */
-void freeObjects() {
+void collectNursery() {
   auto vm = VM::GetInstance();
-  Obj* object = vm->objects;
+  auto start = std::chrono::steady_clock::now();
+  size_t used = vm->nurseryTop - vm->nurseryStart;
+  size_t promoted = vm->gcStats.bytesPromoted;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+#endif
 
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+    forwardValue(*slot);
+  }
+  for (int i = 0; i < vm->frameCount; i++) {
+    forwardObject(vm->frames[i].closure);
+  }
+  for (ObjUpvalue** upvalue = &vm->openUpvalues; *upvalue != NULL; upvalue = &(*upvalue)->next) {
+    forwardObject(*upvalue);
+  }
+  if (vm->globalsRemembered) forwardTable(vm->globals);
+  forwardObject(vm->initString);
+  for (ObjString*& selector : vm->selectors) {
+    forwardObject(selector);
+  }
+  for (Obj*& object : vm->grayStack) {
+    forwardObject(object);
   }
+
+  for (Obj* object : vm->rememberedSet) {
+    object->isRemembered = false;
+    forwardReferences(object);
+  }
+  vm->rememberedSet.clear();
+  vm->globalsRemembered = false;
+
+  while (!vm->promotedStack.empty()) {
+    Obj* object = vm->promotedStack.back();
+    vm->promotedStack.pop_back();
+    forwardReferences(object);
+  }
+
+  // The intern table is weak, so strings that didn't survive drop out of it
+  Entry* entries = vm->strings.getEntries();
+  for (int i = 0; i < vm->strings.getCapacity(); i++) {
+    ObjString* key = entries[i].key;
+    if (key == NULL || !vm->isYoung((Obj*)key)) continue;
+    if (key->obj.next != NULL) {
+      entries[i].key = (ObjString*)key->obj.next;
+    } else {
+      vm->strings.deleteEntry(key);
+    }
+  }
+
+  for (Obj* object : vm->youngOwners) {
+    countYoungOwned(object);
+    if (object->next == NULL) {
+      releaseOwned(object);
+    } else {
+      markOwner(object->next);
+    }
+  }
+  vm->youngOwners.clear();
+
+#ifdef DEBUG_STRESS_GC
+  // Anything still pointing into the nursery should fall over right away
+  memset(vm->nurseryStart, 0xbd, vm->nurseryTop - vm->nurseryStart);
+#endif
+  vm->nurseryTop = vm->nurseryStart;
+  vm->nurseryFull = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   emptied %zu bytes of nursery\n", used);
+#endif
+  double pause = microsecondsSince(start);
+  vm->gcStats.minorCollections++;
+  vm->gcStats.minorPause += pause;
+  vm->gcStats.bytesFreed += used - (vm->gcStats.bytesPromoted - promoted);
+#ifdef GC_PAUSE_STATS
+  minorPauses.push_back(pause);
+#endif
 }
 
-void collectGarbage() {
+/**
+ * Starts a major collection by graying the roots, all at once. What the
+ * collector promises from here on is to keep everything that was reachable
+ * right now, plus everything allocated before it's done marking (which
+ * allocateObject() makes black). VM::snapshotBarrier() keeps the first half
+ * of that promise while the program goes on changing the heap.
+ */
+static void beginCollection() {
   auto vm = VM::GetInstance();
-#ifdef DEBUG_LOG_GC  
+#ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm->bytesAllocated;
+  bytesBeforeGC = vm->bytesAllocated;
 #endif
-
+  vm->gcPhase = GC_MARK;
   markRoots();
-  traceReferences();
+}
+
+/**
+ * Once nothing is gray, anything still white was unreachable when the
+ * collection started, and nothing can reach it now either. This runs in one
+ * go, then the old space's pages get handed over to be swept.
+ */
+static void finishMarking() {
+  auto vm = VM::GetInstance();
   removeWhiteStrings(vm->strings);
-  sweep();
 
-  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+  // Remembered objects that are about to be freed can't stay in the set
+  std::vector<Obj*>& remembered = vm->rememberedSet;
+  remembered.erase(std::remove_if(remembered.begin(), remembered.end(),
+                                  [vm](Obj* object) { return !vm->isMarked(object); }),
+                   remembered.end());
 
-#ifdef DEBUG_LOG_GC  
+  // Young objects got marked in their headers, which sweeping never sees
+  for (uint8_t* at = vm->nurseryStart; at < vm->nurseryTop;
+       at += ALIGN_OBJECT(objectSize((Obj*)at))) {
+    ((Obj*)at)->isMarked = false;
+  }
+
+  startSweeping();
+  vm->gcPhase = GC_SWEEP;
+}
+
+static void finishSweeping() {
+  auto vm = VM::GetInstance();
+  size_t grown = (size_t)(vm->bytesAllocated * vm->gcGrowFactor);
+  vm->nextGC = std::max(grown, vm->bytesAllocated + vm->gcMinInterval);
+  vm->gcPhase = GC_IDLE;
+  vm->gcStats.majorCollections++;
+
+#ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         bytesBeforeGC - vm->bytesAllocated, bytesBeforeGC, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+/**
+ * Does the next increment of the major collection, which runs a little at a
+ * time in between the program's own work. It gets called as objects are
+ * allocated, once there's a collection going or the old space has grown past
+ * nextGC. Each increment traces or sweeps up to gcStepWork objects, and stops
+ * early once it's taken more than gcMaxPause microseconds. With gcStepWork
+ * at 0 every collection runs in one go instead.
+ *
+ * Unlike collectNursery() nothing moves, so this can run anywhere.
+ */
+void collectStep() {
+  auto vm = VM::GetInstance();
+  auto start = std::chrono::steady_clock::now();
+#ifdef DEBUG_STRESS_GC
+  // Keep a collection going all the time, in the smallest increments there
+  // are, so the barriers get a workout
+  size_t work = 1;
+#else
+  size_t work = vm->gcStepWork;
+#endif
+
+  if (work == 0) {
+    collectGarbage();
+  } else if (vm->gcPhase == GC_IDLE) {
+    beginCollection();
+  } else {
+    while (work > 0 && vm->gcPhase != GC_IDLE) {
+      size_t some = std::min(work, (size_t)PAUSE_CHECK_INTERVAL);
+      work -= some;
+      if (vm->gcPhase == GC_MARK) {
+        if (traceReferences(some)) finishMarking();
+      } else if (sweep(some)) {
+        finishSweeping();
+      }
+      if (vm->gcMaxPause > 0 && microsecondsSince(start) > vm->gcMaxPause) break;
+    }
+  }
+
+  double pause = microsecondsSince(start);
+  vm->gcStats.increments++;
+  vm->gcStats.majorPause += pause;
+#ifdef GC_PAUSE_STATS
+  majorPauses.push_back(pause);
 #endif
 }
 
-void removeWhiteStrings(std::map<uint32_t, ObjString*>& strings) {
-  for (auto it = strings.begin(); it != strings.end(); ++it) {
-    if (it->second != NULL && it->second->obj.isMarked) {
-      strings.erase(it);
+/**
+ * Runs a whole major collection at once, after finishing the one in progress
+ * if there is one.
+ */
+void collectGarbage() {
+  auto vm = VM::GetInstance();
+  if (vm->gcPhase == GC_SWEEP) {
+    sweep(SIZE_MAX);
+    finishSweeping();
+  }
+  if (vm->gcPhase == GC_IDLE) beginCollection();
+  traceReferences(SIZE_MAX);
+  finishMarking();
+  sweep(SIZE_MAX);
+  finishSweeping();
+}
+
+/**
+ * The intern table holds weak references, so before sweeping we drop every
+ * string nothing else marked. Otherwise the table would keep pointing at
+ * strings that sweep() is about to free.
+ */
+void removeWhiteStrings(HashTable& strings) {
+  auto vm = VM::GetInstance();
+  Entry* entries = strings.getEntries();
+  for (int i = 0; i < strings.getCapacity(); i++) {
+    Entry* entry = &entries[i];
+    if (entry->key != NULL && !vm->isMarked((Obj*)entry->key)) {
+      strings.deleteEntry(entry->key);
     }
   }
 }
 
 void markRoots() {
   auto vm = VM::GetInstance();
-  for (size_t i = 0; i < vm->stack.size(); i++) {
-    Value slot = vm->stack[i];
-    markValue(slot);
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(*slot);
   }
 
   for (int i = 0; i < vm->frameCount; i++) {
@@ -144,45 +590,32 @@ void markRoots() {
   markTable(vm->globals);
   markCompilerRoots();
   markObject((Obj*)vm->initString);
+  for (ObjString* selector : vm->selectors) {
+    markObject((Obj*)selector);
+  }
 }
 
-void traceReferences() {
+/**
+ * Blackens up to work gray objects. The gray stack stays put in between, so
+ * the next call picks up where this one stopped.
+ * @return true once there's nothing gray left
+ */
+bool traceReferences(size_t work) {
   auto vm = VM::GetInstance();
-  while (vm->grayStack.size() > 0) {
+  while (vm->grayStack.size() > 0 && work-- > 0) {
     Obj* object = vm->grayStack.back();
     vm->grayStack.pop_back();
     blackenObject(object);
   }
+  return vm->grayStack.empty();
 }
 
-void sweep() {
-  auto vm = VM::GetInstance();
-
-  Obj* previous = NULL;
-  Obj* object = vm->objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm->objects = object;
-      }
-
-      freeObject(unreached);
-    }
-  }
-}
-
-void markTable(std::map<ObjString *, Value>& globals) {
-  for (auto it = globals.begin(); it != globals.end(); ++it) {
-    markObject((Obj*)it->first);
-    markValue(it->second);
+void markTable(HashTable& table) {
+  Entry* entries = table.getEntries();
+  for (int i = 0; i < table.getCapacity(); i++) {
+    Entry* entry = &entries[i];
+    markObject((Obj*)entry->key);
+    markValue(entry->value);
   }
 }
 
@@ -190,7 +623,7 @@ void markValue(Value& value) {
   if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
-void markArray(std::vector<Value>& constants) {
+void markArray(CountedVector<Value>& constants) {
   for (Value& value : constants) {
     markValue(value);
   }
@@ -212,14 +645,17 @@ void blackenObject(Obj* object) {
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       markObject((Obj*)klass->name);
-      markTable(klass->methods);
+      for (int i = 0; i < klass->methodCount; i++) {
+        markObject((Obj*)klass->methods[i]);
+      }
+      markObject((Obj*)klass->shape);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
-      for (ObjUpvalue* upvalue : closure->upvalues) {
-        markObject((Obj*)upvalue);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        markObject((Obj*)closure->upvalues[i]);
       }
       break;
     }
@@ -227,12 +663,37 @@ void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(function->chunk.constants);
+      // Cached shapes and methods have to stay alive, or a new shape could
+      // be allocated at the same address and hit a stale entry
+      for (InlineCache& cache : function->chunk.caches) {
+        for (int i = 0; i < cache.count; i++) {
+          markObject((Obj*)cache.entries[i].shape);
+          markObject((Obj*)cache.entries[i].method);
+          markObject((Obj*)cache.entries[i].transition);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
-      markTable(instance->fields);
+      markObject((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(*fieldSlot(instance, i));
+      }
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markTable(shape->slots);
+      markTable(shape->transitions);
       break;
     }
     case OBJ_UPVALUE:
@@ -246,14 +707,52 @@ void blackenObject(Obj* object) {
 
 void markObject(Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return; // Prevent cycles
+  auto vm = VM::GetInstance();
+  if (vm->isMarked(object)) return; // Prevent cycles
 #ifdef DEBUG_LOG_GC  
   printf("%p mark ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
+  vm->setMarked(object);
+  vm->grayStack.push_back(object);
+}
 
+/**
+ * The summary --gc-stats prints after running a script. Pauses count the
+ * time the program was stopped for whole minor collections and for each
+ * increment of the major ones, but not the sweeping the allocator does in
+ * passing.
+ */
+void printGCStats() {
   auto vm = VM::GetInstance();
-  vm->grayStack.push_back(object);
-}
\ No newline at end of file
+  GCStats& stats = vm->gcStats;
+  printf("minor collections %10zu %12.3f ms\n", stats.minorCollections, stats.minorPause / 1000);
+  printf("major collections %10zu %12.3f ms in %zu increments\n", stats.majorCollections,
+         stats.majorPause / 1000, stats.increments);
+  printf("total pause       %10s %12.3f ms\n", "", (stats.minorPause + stats.majorPause) / 1000);
+  printf("bytes freed       %10zu\n", stats.bytesFreed);
+  printf("bytes promoted    %10zu\n", stats.bytesPromoted);
+  printf("heap              %10zu next collection at %zu\n", vm->bytesAllocated, vm->nextGC);
+}
+
+#ifdef GC_PAUSE_STATS
+static void printPauses(const char* kind, std::vector<double>& pauses) {
+  if (pauses.empty()) {
+    printf("%-6s %8d\n", kind, 0);
+    return;
+  }
+  std::sort(pauses.begin(), pauses.end());
+  auto percentile = [&](double p) { return pauses[(size_t)(p * (pauses.size() - 1))]; };
+  printf("%-6s %8zu %10.1f %10.1f %10.1f\n", kind, pauses.size(),
+         percentile(0.5), percentile(0.99), pauses.back());
+}
+
+// How long the program was stopped for each minor collection and each major
+// collection increment
+void printPauseStats() {
+  printf("%-6s %8s %10s %10s %10s\n", "gc", "pauses", "p50 us", "p99 us", "max us");
+  printPauses("minor", minorPauses);
+  printPauses("major", majorPauses);
+}
+#endif
@@ -2,6 +2,8 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "table.h"
+#include "heap.h"
 #include <map>
 
 #define ALLOCATE(type, count) \
@@ -19,16 +21,50 @@
   (type *)reallocate(pointer, sizeof(type) * (oldCount), \
                      sizeof(type) * (newCount))
 
+// How big the young generation is, and the biggest object that starts out in
+// it. Anything bigger goes straight into the old space.
+#define NURSERY_SIZE (1024 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
+// Where the major collector is in its cycle, see collectStep()
+typedef enum {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP,
+} GCPhase;
+
+// What --gc-stats reports, see printGCStats()
+typedef struct {
+  size_t minorCollections;
+  size_t majorCollections;
+  size_t increments;
+  double minorPause;
+  double majorPause;
+  size_t bytesFreed;
+  size_t bytesPromoted;
+} GCStats;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+Obj* allocateYoung(size_t size);
+Obj* allocateOld(size_t size);
+void freeLastYoung(Obj* object, size_t size);
+void rememberObject(Obj* object);
+void ownsMemory(Obj* object);
+void releaseOwned(Obj* object);
+void collectNursery();
 void markRoots();
 void markValue(Value& value);
 void markObject(Obj* object);
-void markTable(std::map<ObjString *, Value>& globals);
+void markTable(HashTable& table);
+void collectStep();
 void collectGarbage();
 void freeObjects();
-void traceReferences();
-void removeWhiteStrings(std::map<uint32_t, ObjString*>& strings);
-void sweep();
+bool traceReferences(size_t work);
+void removeWhiteStrings(HashTable& strings);
 void blackenObject(Obj* object);
+void printGCStats();
+#ifdef GC_PAUSE_STATS
+void printPauseStats();
+#endif
 
 #endif
\ No newline at end of file
@@ -1,28 +1,54 @@
 #include <string>
+#include <new>
+#include <vector>
 #include "object.h"
 #include "memory.h"
+#include "hash.h"
 #include "vm.h"
 
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
+/**
+ * Functions, classes, shapes and natives live about as long as the program
+ * does, and functions and shapes hold C++ containers that can't be moved
+ * with memcpy(), so they skip the nursery.
+ */
+static bool isLongLived(ObjType type) {
+  return type == OBJ_FUNCTION || type == OBJ_CLASS || type == OBJ_SHAPE ||
+         type == OBJ_NATIVE;
 }
 
+/**
+ * Objects come back from the allocator as raw memory, so any object that
+ * holds a C++ container has to construct it in place with placement new,
+ * otherwise we're assigning into garbage. It also has to call ownsMemory(),
+ * so whatever the container allocates gets freed along with the object.
+ *
+ * Anything that isn't long lived starts out young, in the nursery, unless
+ * that's full. An object that goes straight into the old space is remembered
+ * from birth, since whatever the caller fills it in with may well be young.
+ * Strings don't hold references, and takeString() may free them right away.
+ *
+ * Objects allocated while a major collection is marking start out black.
+ */
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  auto vm = VM::GetInstance();
+  Obj* object = NULL;
+  if (!isLongLived(type)) {
+    // allocateOld() takes the collector's next step for old objects. This has
+    // to come first, since finishMarking() walks the nursery.
+    if (vm->gcPhase != GC_IDLE) collectStep();
+    object = allocateYoung(size);
+  }
+  bool young = object != NULL;
+  if (!young) object = allocateOld(size);
+  object->next = NULL;
   object->type = type;
   object->isMarked = false;
-
-  auto vm = VM::GetInstance();
-  object->next = vm->objects;
-  vm->objects = object;
+  if (vm->gcPhase == GC_MARK) vm->setMarked(object);
+  object->isRemembered = false;
+  if (!young && type != OBJ_STRING) rememberObject(object);
 
 #ifdef DEBUG_LOG_GC  
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -38,23 +64,42 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
   return bound;
 }
 
+static ObjShape* newShape() {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->fieldCount = 0;
+  new (&shape->slots) HashTable();
+  new (&shape->transitions) HashTable();
+  ownsMemory((Obj*)shape);
+  return shape;
+}
+
 ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
+  klass->methods = NULL;
+  klass->methodCount = 0;
+  klass->shape = NULL;
+  klass->instanceFields = 0;
+  ownsMemory((Obj*)klass);
+
+  auto vm = VM::GetInstance();
+  vm->push(OBJ_VAL(klass));
+  klass->shape = newShape();
+  vm->pop();
   return klass;
 }
 
+/**
+ * The upvalue pointers are stored right after the header, like a string's
+ * characters, so a closure is a single allocation.
+ */
 ObjClosure* newClosure(ObjFunction* function) {
-  std::vector<ObjUpvalue*> upvalues = std::vector<ObjUpvalue*>();
-
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues.push_back(NULL);
-  }
-
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  int upvalueCount = function->upvalueCount;
+  ObjClosure* closure = (ObjClosure*)allocateObject(
+      sizeof(ObjClosure) + sizeof(ObjUpvalue*) * upvalueCount, OBJ_CLOSURE);
+  closure->upvalueCount = upvalueCount;
   closure->function = function;
-  closure->upvalues = upvalues;
-  closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < upvalueCount; i++) closure->upvalues[i] = NULL;
   return closure;
 }
 
@@ -62,17 +107,123 @@ ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->name = NULL;
-  function->chunk = Chunk();
+  function->upvalueCount = 0;
+  function->maxStackDepth = 0;
+  new (&function->chunk) Chunk();
+  new (&function->registerChunk) Chunk();
+  ownsMemory((Obj*)function);
   return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
-  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  int inlineCount = klass->instanceFields;
+  ObjInstance* instance = (ObjInstance*)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * inlineCount, OBJ_INSTANCE);
   instance->klass = klass;
-  // I don't think I need to initiate the map, it should be empty by default
+  instance->shape = klass->shape;
+  instance->inlineCount = inlineCount;
+  instance->overflowCapacity = 0;
+  instance->overflow = NULL;
   return instance;
 }
 
+/**
+ * Grows klass's method table to cover selector if it has to, then fills the
+ * entry in. Growing can trigger a GC, so klass and method have to be
+ * reachable.
+ */
+void defineClassMethod(ObjClass* klass, int selector, ObjClosure* method) {
+  if (selector >= klass->methodCount) {
+    int oldCount = klass->methodCount;
+    klass->methods = GROW_ARRAY(ObjClosure*, klass->methods, oldCount, selector + 1);
+    for (int i = oldCount; i <= selector; i++) klass->methods[i] = NULL;
+    klass->methodCount = selector + 1;
+  }
+  VM::GetInstance()->snapshotBarrier((Obj*)klass->methods[selector]);
+  klass->methods[selector] = method;
+  VM::GetInstance()->writeBarrier((Obj*)klass, (Obj*)method);
+}
+
+/**
+ * Copies superclass's whole method table into subclass, which doesn't have
+ * any methods of its own yet.
+ */
+void inheritMethods(ObjClass* subclass, ObjClass* superclass) {
+  int count = superclass->methodCount;
+  if (count == 0) return;
+
+  subclass->methods = GROW_ARRAY(ObjClosure*, subclass->methods, subclass->methodCount, count);
+  subclass->methodCount = count;
+  memcpy(subclass->methods, superclass->methods, sizeof(ObjClosure*) * count);
+  auto vm = VM::GetInstance();
+  for (int i = 0; i < count; i++) {
+    vm->writeBarrier((Obj*)subclass, (Obj*)subclass->methods[i]);
+  }
+}
+
+/**
+ * The slot name lives in for instances of shape, or -1 if they don't have it.
+ */
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!shape->slots.lookup(name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+/**
+ * The shape you get by adding name to shape. It gets made the first time
+ * any instance takes that step and is shared after that. The caller has to
+ * keep shape reachable.
+ */
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+  Value next;
+  if (shape->transitions.lookup(name, &next)) return AS_SHAPE(next);
+
+  auto vm = VM::GetInstance();
+  ObjShape* child = newShape();
+  vm->push(OBJ_VAL(child));
+  child->slots.addAll(shape->slots);
+  child->slots.add(name, NUMBER_VAL((double)shape->fieldCount));
+  child->fieldCount = shape->fieldCount + 1;
+  shape->transitions.add(name, OBJ_VAL(child));
+  vm->writeBarrier((Obj*)shape, (Obj*)name);
+  vm->pop();
+  return child;
+}
+
+/**
+ * Moves instance to shape, which has to be a transition from its current
+ * shape, and stores value in the new field. value has to be reachable, since
+ * growing overflow can trigger a GC.
+ */
+void addField(ObjInstance* instance, ObjShape* shape, Value value) {
+  int slot = shape->fieldCount - 1;
+  int overflowSlot = slot - instance->inlineCount;
+  auto vm = VM::GetInstance();
+  if (overflowSlot >= instance->overflowCapacity) {
+    int oldCapacity = instance->overflowCapacity;
+    instance->overflowCapacity = GROW_CAPACITY(oldCapacity);
+    instance->overflow = GROW_ARRAY(Value, instance->overflow, oldCapacity,
+                                    instance->overflowCapacity);
+    // A young instance's overflow isn't old space yet, see countYoungOwned()
+    if (vm->isYoung((Obj*)instance)) {
+      countBytes(sizeof(Value) * instance->overflowCapacity,
+                 sizeof(Value) * oldCapacity);
+    }
+    if (oldCapacity == 0) ownsMemory((Obj*)instance);
+  }
+
+  vm->snapshotBarrier((Obj*)instance->shape);
+  instance->shape = shape;
+  *fieldSlot(instance, slot) = value;
+  vm->writeBarrier((Obj*)instance, value);
+
+  ObjClass* klass = instance->klass;
+  if (shape->fieldCount > klass->instanceFields) {
+    klass->instanceFields = shape->fieldCount;
+  }
+}
+
 ObjNative* newNative(NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
@@ -82,16 +233,27 @@ ObjNative* newNative(NativeFn function) {
 #define ALLOCATE_OBJ(type, objectType) \
   (type*)allocateObject(sizeof(type), objectType)
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/**
+ * Strings are a single allocation, with the characters stored right after the
+ * header in the chars flexible array member. The string isn't interned yet,
+ * and its hash isn't set.
+ */
+static ObjString* allocateString(int length) {
+  ObjString* str = (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
   str->length = length;
-  str->chars = chars;
+  str->hash = 0;
+  str->selector = -1;
+  str->chars[length] = '\0';
+  return str;
+}
+
+static ObjString* internString(ObjString* str, uint32_t hash) {
   str->hash = hash;
 
   auto vm = VM::GetInstance();
-  vm->stack.push_back(OBJ_VAL(str));
-  vm->strings.insert(std::pair<uint32_t, ObjString*>(hash, str));
-  vm->stack.pop_back();
+  vm->push(OBJ_VAL(str));
+  vm->strings.add(str, NIL_VAL);
+  vm->pop();
 
   return str;
 }
@@ -100,24 +262,109 @@ ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
   auto vm = VM::GetInstance();
-  auto search = vm->strings.find(hash);
-  if (search != vm->strings.end()) {
-    return vm->strings[hash];
+  ObjString* interned = vm->strings.findString(chars, length, hash);
+  if (interned != NULL) {
+    // The intern table is weak, so this may be the only way left to it
+    vm->snapshotBarrier((Obj*)interned);
+    return interned;
   }
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* str = allocateString(length);
+  memcpy(str->chars, chars, length);
+  return internString(str, hash);
+}
+
+/**
+ * Makes a string with room for length characters for the caller to fill in,
+ * e.g. when concatenating, so the bytes only get written once.
+ *
+ * The string isn't hashed or interned. That's fine for values that only get
+ * printed and compared (see stringsEqual()), and saves hashing the results of
+ * concatenations nobody ever looks up. Anything that will be used as a table
+ * key has to go through takeString() first.
+ */
+ObjString* makeString(int length) {
+  return allocateString(length);
+}
+
+ObjRope* newRope(Obj* left, Obj* right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
 }
 
 /**
- * TODO: This is definitely not going to work.
- * The location is suppose to refer to the location in the slot (aka index),
- * not just the slot itself. This is something I'd have to fix if I ever want
- * to get this compiler working, but I doubt I ever will.
+ * Calls fn(chars, length) on each flat piece of rope, left to right. We keep
+ * our own stack of pending nodes instead of recursing, since appending in a
+ * loop builds ropes thousands of levels deep. Nothing here goes through
+ * reallocate(), so it's safe to call while the GC is running.
  */
-ObjUpvalue* newUpvalue(std::vector<Value>& slot) {
+template <typename Fn>
+static void forEachPiece(ObjRope* rope, Fn fn) {
+  std::vector<Obj*> pending;
+  pending.push_back((Obj*)rope);
+  while (!pending.empty()) {
+    Obj* node = pending.back();
+    pending.pop_back();
+
+    if (node->type == OBJ_STRING) {
+      ObjString* string = (ObjString*)node;
+      fn(string->chars, string->length);
+      continue;
+    }
+
+    ObjRope* inner = (ObjRope*)node;
+    if (inner->flat != NULL) {
+      fn(inner->flat->chars, inner->flat->length);
+    } else {
+      pending.push_back(inner->right);
+      pending.push_back(inner->left);
+    }
+  }
+}
+
+/**
+ * Copies the rope into a single string, once. The caller has to keep the rope
+ * reachable, since making the string can trigger a GC.
+ */
+ObjString* flattenRope(ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  ObjString* result = makeString(rope->length);
+  int offset = 0;
+  forEachPiece(rope, [&](const char* chars, int length) {
+    memcpy(result->chars + offset, chars, length);
+    offset += length;
+  });
+
+  rope->flat = result;
+  rope->left = NULL;
+  rope->right = NULL;
+  VM::GetInstance()->writeBarrier((Obj*)rope, (Obj*)result);
+  return rope->flat;
+}
+
+/**
+ * Equality for when at least one side is a rope. Both values have to be
+ * reachable from the stack, since flattening allocates.
+ */
+bool textEqual(Value a, Value b) {
+  if (!IS_TEXT(a) || !IS_TEXT(b)) return false;
+  if (textLength(a) != textLength(b)) return false;
+
+  ObjString* left = IS_ROPE(a) ? flattenRope(AS_ROPE(a)) : AS_STRING(a);
+  ObjString* right = IS_ROPE(b) ? flattenRope(AS_ROPE(b)) : AS_STRING(b);
+  return stringsEqual(left, right);
+}
+
+/**
+ * location points at the captured variable's slot on the VM stack while the
+ * upvalue is open, and at its own closed field once it gets closed.
+ */
+ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
@@ -144,6 +391,15 @@ void printObject(Value value) {
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
       break;
+    case OBJ_ROPE:
+      // No need to flatten just to print it
+      forEachPiece(AS_ROPE(value), [](const char* chars, int length) {
+        printf("%.*s", length, chars);
+      });
+      break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
@@ -162,15 +418,25 @@ void printObject(Value value) {
   }
 }
 
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
+/**
+ * Interns a string from makeString(), taking ownership of it. If an equal
+ * string already exists we hand that back instead and free ours right away,
+ * though a young one only when nothing has been allocated after it.
+ */
+ObjString* takeString(ObjString* string) {
+  uint32_t hash = hashString(string->chars, string->length);
 
   auto vm = VM::GetInstance();
-  auto search = vm->strings.find(hash);
-  if (search != vm->strings.end()) {
-    FREE_ARRAY(char, chars, length + 1);
-    return vm->strings[hash];
+  ObjString* interned = vm->strings.findString(string->chars, string->length, hash);
+  if (interned != NULL) {
+    if (vm->isYoung((Obj*)string)) {
+      freeLastYoung((Obj*)string, sizeof(ObjString) + string->length + 1);
+    } else {
+      freeCell((Obj*)string);
+    }
+    vm->snapshotBarrier((Obj*)interned);
+    return interned;
   }
   
-  return allocateString(chars, length, hash);
+  return internString(string, hash);
 }
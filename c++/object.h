@@ -3,7 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
-#include <map>
+#include "table.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -13,7 +13,11 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+// Anything Lox code sees as a string, flat or not
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
 
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -22,6 +26,8 @@
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
@@ -32,13 +38,22 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
 
+/**
+ * Only young objects use next and isMarked. next is NULL until a minor
+ * collection promotes the object, and then points at its copy in the old
+ * space. Old objects are marked in their page's bitmap instead (see heap.h).
+ * isRemembered is set while an old object is in VM::rememberedSet.
+ */
 struct Obj {
   ObjType type;
   bool isMarked;
+  bool isRemembered;
   struct Obj* next;
 };
 
@@ -46,11 +61,18 @@ typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // Most stack slots a call to this function can use, counting the callee
+  // slot, so the VM only has to check for overflow once when it calls it
+  int maxStackDepth;
   Chunk chunk;
+  // The same function translated for the register machine, with its own copy
+  // of the constants. Empty unless we're running with --registers and the
+  // compiler could translate everything the function does.
+  Chunk registerChunk;
   ObjString* name;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, std::vector<Value>& args);
+typedef Value (*NativeFn)(int argCount, Value* args);
 
 typedef struct {
   Obj obj;
@@ -60,34 +82,95 @@ typedef struct {
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
+  // Only set once the string is interned, 0 until then
   uint32_t hash;
+  // Index into every class's method table once some class has defined a
+  // method with this name, -1 until then. See VM::selectorOf().
+  int selector;
+  char chars[];
 };
 
+// Concatenations shorter than this are just done eagerly
+#define ROPE_MIN_LENGTH 64
+
+/**
+ * The result of a long string concatenation, kept as a tree of the two
+ * operands so building a string in a loop is linear instead of quadratic.
+ * left and right are each an ObjString or another ObjRope. The characters
+ * only get copied and interned the first time something needs the whole
+ * string (see flattenRope()), after which flat is set and the children are
+ * dropped.
+ */
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
-  std::vector<Value> location;
+  Value* location;
   Value closed;
   struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction* function;
-  std::vector<ObjUpvalue*> upvalues;
   int upvalueCount;
+  ObjUpvalue* upvalues[];
 } ObjClosure;
 
-typedef struct {
+/**
+ * A hidden class: the field layout shared by every instance that added the
+ * same fields in the same order. slots maps each field name to its index in
+ * the instance (as a number), and transitions maps a name to the shape you
+ * get by adding that field next, so instances built the same way walk the
+ * same chain of shapes. Each class has its own empty root shape, which means
+ * a shape also pins down the class and inline caches only have to compare
+ * shapes.
+ */
+typedef struct ObjShape {
+  Obj obj;
+  int fieldCount;
+  HashTable slots;
+  HashTable transitions;
+} ObjShape;
+
+/**
+ * methods is a vtable indexed by selector (see ObjString), NULL where the
+ * class has no method with that name. It's only as long as the class's
+ * highest selector. OP_INHERIT copies the superclass's table down before any
+ * methods of the subclass are defined, so overriding is just overwriting an
+ * entry and looking up a method never walks the hierarchy.
+ */
+typedef struct ObjClass {
   Obj obj;
   ObjString* name;
-  std::map<ObjString*, Value> methods;
+  ObjClosure** methods;
+  int methodCount;
+  // The empty shape every new instance starts out with
+  ObjShape* shape;
+  // Most fields any instance has had so far, see ObjInstance
+  int instanceFields;
 } ObjClass;
 
+/**
+ * Field values sit in the slots their shape gives them. The first
+ * inlineCount slots are stored right after the header. That's sized from
+ * how many fields earlier instances of the class ended up with, so normally
+ * every field is inline. Anything past that spills into overflow.
+ */
 typedef struct {
   Obj obj;
   ObjClass* klass;
-  std::map<ObjString*, Value> fields;
+  ObjShape* shape;
+  int inlineCount;
+  int overflowCapacity;
+  Value* overflow;
+  Value fields[];
 } ObjInstance;
 
 typedef struct {
@@ -102,13 +185,53 @@ ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjRope* newRope(Obj* left, Obj* right, int length);
+void defineClassMethod(ObjClass* klass, int selector, ObjClosure* method);
+void inheritMethods(ObjClass* subclass, ObjClass* superclass);
+int shapeSlot(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+void addField(ObjInstance* instance, ObjShape* shape, Value value);
+ObjString* flattenRope(ObjRope* rope);
+bool textEqual(Value a, Value b);
+ObjString* makeString(int length);
+ObjString* takeString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(std::vector<Value>& slot);
+ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/**
+ * Interned strings are equal exactly when they're the same object, but
+ * strings from makeString() aren't interned, so past the pointer check we
+ * compare the characters. Differing hashes rule out a match early when both
+ * sides have one.
+ */
+static inline bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  if (a->length != b->length) return false;
+  if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+  return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+/**
+ * The method klass has for name, or NULL. A name no class has defined a
+ * method for doesn't have a selector yet, so it falls out of the range check.
+ */
+static inline ObjClosure* findMethod(ObjClass* klass, ObjString* name) {
+  if ((unsigned)name->selector >= (unsigned)klass->methodCount) return NULL;
+  return klass->methods[name->selector];
+}
+
+static inline Value* fieldSlot(ObjInstance* instance, int slot) {
+  if (slot < instance->inlineCount) return &instance->fields[slot];
+  return &instance->overflow[slot - instance->inlineCount];
+}
+
+static inline int textLength(Value value) {
+  return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
 #endif
\ No newline at end of file
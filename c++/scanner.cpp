@@ -10,8 +10,8 @@ static bool isAlpha(char c) {
          c == '_';
 }
 
-Scanner::Scanner(const std::string& source) {
-  this->source = std::move(source);
+Scanner::Scanner(std::string_view source) {
+  this->source = source;
   start = 0;
   current = 0;
   line = 1;
@@ -37,16 +37,20 @@ Token Scanner::makeToken(TokenType type) {
   return Token(type, start, current - start, line, source);
 }
 
-Token Scanner::errorToken(const std::string& message) {
-  return Token(TOKEN_ERROR, 0, message.size(), line, message);
+// message has to be a literal, since the token only points at it
+Token Scanner::errorToken(const char* message) {
+  std::string_view text(message);
+  return Token(TOKEN_ERROR, 0, text.size(), line, text);
 }
 
+// A view has no terminator to read, so running off the end gives one here
 char Scanner::peek() {
+  if (isAtEnd()) return '\0';
   return source[current];
 }
 
 char Scanner::peekNext() {
-  if (isAtEnd()) return '\0';
+  if (current + 1 >= source.size()) return '\0';
   return source[current+1];
 }
 
@@ -106,8 +110,17 @@ Token Scanner::identifier() {
   return makeToken(identifierType());
 }
 
-TokenType Scanner::checkKeyword(size_t start, size_t length, const std::string& rest, TokenType type) {
-  return (source.substr(start, length) == rest) ? type : TOKEN_IDENTIFIER;
+/**
+ * start here is relative to the beginning of the token, not the source, so we
+ * have to offset by this->start. The lengths also have to match exactly, or
+ * else something like "orchid" would get scanned as "or".
+ */
+TokenType Scanner::checkKeyword(size_t start, size_t length, const char* rest, TokenType type) {
+  if (current - this->start == start + length &&
+      source.compare(this->start + start, length, rest) == 0) {
+    return type;
+  }
+  return TOKEN_IDENTIFIER;
 }
 
 TokenType Scanner::identifierType() {
@@ -119,8 +132,8 @@ TokenType Scanner::identifierType() {
       if (current - start > 1) {
         switch (source[start+1]) {
           case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 2, "or", TOKEN_FOR);          
-          case 'u': return checkKeyword(2, 2, "un", TOKEN_FUN);
+          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);          
+          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
         }
       }
       break;
@@ -134,7 +147,7 @@ TokenType Scanner::identifierType() {
       if (current - start > 1) {
         switch (source[start+1]) {
           case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);          
-          case 'r': return checkKeyword(2, 3, "rue", TOKEN_TRUE);          
+          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);          
         }
       }
       break;
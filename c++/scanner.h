@@ -2,6 +2,7 @@
 #define clox_scanner_h
 
 #include <string>
+#include <string_view>
 
 typedef enum {
   // Single-character tokens.
@@ -31,7 +32,8 @@ class Token {
     size_t start;
     size_t length;
     size_t line;
-    std::string source;
+    // A view of the whole program, which has to outlive every token
+    std::string_view source;
     Token() {
       this->type = TOKEN_ERROR;
       this->start = 0;
@@ -39,18 +41,23 @@ class Token {
       this->line = 0;
       this->source = "";
     }
-    Token(TokenType type, size_t start, size_t length, size_t line, const std::string& source) {
+    Token(TokenType type, size_t start, size_t length, size_t line, std::string_view source) {
       this->type = type;
       this->start = start;
       this->length = length;
       this->line = line;
       this->source = source;
     }
+    // The actual text of the token, since source holds the whole program
+    std::string_view lexeme() const {
+      return source.substr(start, length);
+    }
 };
 
 class Scanner {
   private:
-    std::string source;
+    // Not a copy, so the caller keeps the program alive until it's compiled
+    std::string_view source;
     size_t start;
     size_t current;
     size_t line;
@@ -62,14 +69,14 @@ class Scanner {
     Token number();
     Token identifier();
     TokenType identifierType();
-    TokenType checkKeyword(size_t start, size_t length, const std::string& rest, TokenType type);
+    TokenType checkKeyword(size_t start, size_t length, const char* rest, TokenType type);
 
   public:
-    Scanner(const std::string& source);
+    Scanner(std::string_view source);
     char advance();
     Token scanToken();
     Token makeToken(TokenType type);
-    Token errorToken(const std::string& message);
+    Token errorToken(const char* message);
     bool match(char expected);
 };
 
@@ -2,7 +2,10 @@
 #include "object.h"
 #include "memory.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Max load factor is 3/4, kept as integers so add() doesn't need any floating
+// point math
+#define TABLE_MAX_LOAD_NUM 3
+#define TABLE_MAX_LOAD_DEN 4
 
 HashTable::HashTable() {
   count = 0;
@@ -10,13 +13,16 @@ HashTable::HashTable() {
   entries = NULL;
 }
 
+/**
+ * @return true if key wasn't in the table before
+ */
 bool HashTable::add(ObjString* key, Value value) {
-  if (count + 1 > capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(capacity);
-    adjustCapacity(capacity);
+  if ((count + 1) * TABLE_MAX_LOAD_DEN > capacity * TABLE_MAX_LOAD_NUM) {
+    adjustCapacity(GROW_CAPACITY(capacity));
   }
   Entry* entry = findEntry(key);
   bool isNewKey = entry->key == NULL;
+  // Reusing a tombstone doesn't change the count, it was already counted
   if (isNewKey && IS_NIL(entry->value)) {
     count++;
   }
@@ -26,10 +32,14 @@ bool HashTable::add(ObjString* key, Value value) {
   return isNewKey;
 }
 
-Entry* tombstone = NULL;
-
+/**
+ * Returns the entry for key, or where it should go if it isn't there. That's
+ * the first tombstone we passed if there was one, so deleted slots get reused.
+ */
 Entry* HashTable::findEntry(ObjString* key) {
-  uint32_t index = key->hash % capacity;
+  uint32_t mask = capacity - 1;
+  uint32_t index = key->hash & mask;
+  Entry* tombstone = NULL;
   for (;;) {
     Entry* entry = &entries[index];
     if (entry->key == NULL) {
@@ -42,12 +52,16 @@ Entry* HashTable::findEntry(ObjString* key) {
       return entry;
     }
 
-    index = (index + 1) % capacity;
+    index = (index + 1) & mask;
   }
 }
 
-void HashTable::adjustCapacity(int Capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
+void HashTable::adjustCapacity(int newCapacity) {
+  Entry* oldEntries = entries;
+  int oldCapacity = capacity;
+
+  entries = ALLOCATE(Entry, newCapacity);
+  capacity = newCapacity;
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
     entries[i].value = NIL_VAL;
@@ -55,8 +69,8 @@ void HashTable::adjustCapacity(int Capacity) {
 
   // Re-fill table, notice tombstones get discarded here
   count = 0;
-  for (int i = 0; i < capacity; i++) {
-    Entry *entry = &entries[i];
+  for (int i = 0; i < oldCapacity; i++) {
+    Entry *entry = &oldEntries[i];
     if (entry->key == NULL) continue;
 
     Entry* dest = findEntry(entry->key);
@@ -65,9 +79,7 @@ void HashTable::adjustCapacity(int Capacity) {
     count++;
   }
 
-  FREE_ARRAY(Entry, entries, capacity);
-  this->entries = entries;
-  this->capacity = capacity;
+  FREE_ARRAY(Entry, oldEntries, oldCapacity);
 }
 
 bool HashTable::lookup(ObjString* key, Value* value) {
@@ -80,6 +92,20 @@ bool HashTable::lookup(ObjString* key, Value* value) {
   return true;
 }
 
+/**
+ * Like add(), but only overwrites a key that's already in the table.
+ * @return false if key wasn't there, in which case nothing changes
+ */
+bool HashTable::assign(ObjString* key, Value value) {
+  if (count == 0) return false;
+
+  Entry* entry = findEntry(key);
+  if (entry->key == NULL) return false;
+
+  entry->value = value;
+  return true;
+}
+
 bool HashTable::deleteEntry(ObjString* key) {
   if (count == 0) return false;
 
@@ -90,4 +116,58 @@ bool HashTable::deleteEntry(ObjString* key) {
   entry->key = NULL;
   entry->value = BOOL_VAL(true);
   return true;
-}
\ No newline at end of file
+}
+
+/**
+ * Copies every entry of from into this table, overwriting keys we already
+ * have.
+ */
+void HashTable::addAll(HashTable& from) {
+  for (int i = 0; i < from.capacity; i++) {
+    Entry* entry = &from.entries[i];
+    if (entry->key != NULL) {
+      add(entry->key, entry->value);
+    }
+  }
+}
+
+/**
+ * Used by string interning, where we don't have an ObjString yet and so can't
+ * compare keys by pointer. Instead we check the hash, then the length, then
+ * the actual characters, so strings that only share a hash never get merged.
+ * Nothing gets allocated here, a hit just hands back the existing string.
+ */
+ObjString* HashTable::findString(const char* chars, int length, uint32_t hash) {
+  if (count == 0) return NULL;
+
+  uint32_t mask = capacity - 1;
+  uint32_t index = hash & mask;
+  for (;;) {
+    Entry* entry = &entries[index];
+    if (entry->key == NULL) {
+      // Stop at an empty slot, but keep going past tombstones
+      if (IS_NIL(entry->value)) return NULL;
+    } else if (entry->key->hash == hash &&
+               entry->key->length == length &&
+               memcmp(entry->key->chars, chars, length) == 0) {
+      return entry->key;
+    }
+
+    index = (index + 1) & mask;
+  }
+}
+
+void HashTable::freeTable() {
+  FREE_ARRAY(Entry, entries, capacity);
+  count = 0;
+  capacity = 0;
+  entries = NULL;
+}
+
+int HashTable::getCapacity() {
+  return capacity;
+}
+
+Entry* HashTable::getEntries() {
+  return entries;
+}
@@ -10,6 +10,14 @@ typedef struct
   Value value;
 } Entry;
 
+/**
+ * Open addressing hash table keyed on interned strings, so keys can be
+ * compared by pointer and we can use the hash cached on the ObjString.
+ *
+ * capacity is always a power of two, which lets us wrap the probe index with
+ * a mask instead of %. Deleted entries leave a tombstone behind (NULL key,
+ * true value) so probe sequences running through them don't get cut short.
+ */
 class HashTable
 {
 private:
@@ -21,9 +29,15 @@ public:
   HashTable();
   bool add(ObjString* key, Value value);
   bool lookup(ObjString* key, Value* value);
+  bool assign(ObjString* key, Value value);
   bool deleteEntry(ObjString* key);
   Entry* findEntry(ObjString* key);
   void adjustCapacity(int capacity);
+  void addAll(HashTable& from);
+  ObjString* findString(const char* chars, int length, uint32_t hash);
+  void freeTable();
+  int getCapacity();
+  Entry* getEntries();
 };
 
-#endif
\ No newline at end of file
+#endif
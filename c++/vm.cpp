@@ -7,82 +7,364 @@
 #include "memory.h"
 #include <string>
 #include <cstring>
+#include <algorithm>
 
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Whether the frame is running its function's register code
+static bool isRegisterFrame(CallFrame* frame) {
+  CountedVector<uint8_t>& code = frame->closure->function->registerChunk.code;
+  return frame->ip > code.data() && frame->ip <= code.data() + code.size();
+}
+
+/**
+ * Short results get copied into a new string right away. Past
+ * ROPE_MIN_LENGTH we just make a rope pointing at both operands, so that
+ * appending to a long string doesn't copy it every time.
+ */
 void VM::concatenate() {
-  ObjString* b = AS_STRING(stack.back());
-  ObjString* a = AS_STRING(stack.back());
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  int length = textLength(peek(1)) + textLength(peek(0));
+  if (length >= ROPE_MIN_LENGTH) {
+    ObjRope* rope = newRope(AS_OBJ(peek(1)), AS_OBJ(peek(0)), length);
+    pop();
+    pop();
+    push(OBJ_VAL(rope));
+    return;
+  }
+
+  // Ropes are always at least ROPE_MIN_LENGTH long, so both sides are flat
+  ObjString* b = AS_STRING(peek(0));
+  ObjString* a = AS_STRING(peek(1));
 
   // We shouldn't pop these strings yet, because they can be garbage-collected
-  // in the allocate for chars
-  stack.pop_back();
-  stack.pop_back();
-  ObjString* result = takeString(chars, length);
-  stack.push_back(OBJ_VAL(result));
+  // in the allocation for the result
+  ObjString* result = makeString(length);
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+
+  pop();
+  pop();
+  push(OBJ_VAL(result));
+}
+
+#ifdef INLINE_CACHE_STATS
+#define CACHE_HIT(cache) ((cache)->hits++)
+#define CACHE_MISS(cache) ((cache)->misses++)
+#else
+#define CACHE_HIT(cache) do {} while (false)
+#define CACHE_MISS(cache) do {} while (false)
+#endif
+
+/**
+ * Minor collections move objects, so they only run at safepoints: loop back
+ * edges and returns. Everything live is reachable from the VM's roots there,
+ * and no handler is in the middle of using an object it got from the heap.
+ * Stress builds collect at every one to flush out anything that isn't.
+ */
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() collectNursery()
+#else
+#define SAFEPOINT() do { if (nurseryFull) collectNursery(); } while (false)
+#endif
+
+/**
+ * The cache's entry for shape, or NULL on a miss. Most sites only ever see one
+ * shape, so this is usually a single compare.
+ */
+static inline CacheEntry* findCacheEntry(InlineCache* cache, ObjShape* shape) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+/**
+ * Remembers what the slow path found for shape, reusing shape's entry if it
+ * already has one.
+ */
+static void updateCache(InlineCache* cache, ObjShape* shape, int slot,
+                        ObjClosure* method, ObjShape* transition = NULL) {
+  CacheEntry* entry = findCacheEntry(cache, shape);
+  if (entry == NULL) {
+    if (cache->count < INLINE_CACHE_SIZE) {
+      entry = &cache->entries[cache->count++];
+    } else {
+      entry = &cache->entries[cache->next];
+      cache->next = (cache->next + 1) % INLINE_CACHE_SIZE;
+    }
+  }
+  // Overwriting an entry drops its references, like a store into the function
+  VM* vm = VM::GetInstance();
+  vm->snapshotBarrier((Obj*)entry->shape);
+  vm->snapshotBarrier((Obj*)entry->method);
+  vm->snapshotBarrier((Obj*)entry->transition);
+  entry->shape = shape;
+  entry->slot = slot;
+  entry->method = method;
+  entry->transition = transition;
+
+  // The cache belongs to the function running in the top frame
+  vm->writeBarrier((Obj*)vm->frames[vm->frameCount - 1].closure->function, (Obj*)method);
+}
+
+#ifdef TIME_STARTUP
+#include <chrono>
+
+// Taken while statics get initialized, about as close to exec() as we can get
+static const auto processStart = std::chrono::steady_clock::now();
+
+// Prints how long it took to get from starting up to running the first
+// instruction: reading the source, compiling it or loading its .loxc
+static void reportStartup() {
+  static bool reported = false;
+  if (reported) return;
+  reported = true;
+  auto now = std::chrono::steady_clock::now();
+  fprintf(stderr, "time to first instruction: %.3f ms\n",
+          std::chrono::duration<double, std::milli>(now - processStart).count());
+}
+#endif
+
+#ifdef PROFILE_OPCODES
+// How many times each opcode, and each run of two and three opcodes executed
+// back to back, ran. Runs get cut at anything that can transfer control, so
+// they're all straight-line code the peephole pass could fuse.
+static uint64_t opCounts[OPCODE_COUNT];
+static uint64_t pairCounts[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t tripleCounts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static int lastOps[2] = {-1, -1};
+// The register machine only counts single instructions, to compare totals
+static uint64_t registerOpCounts[REGISTER_OPCODE_COUNT];
+
+static bool endsRun(uint8_t instruction) {
+  switch (instruction) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_RETURN:
+    case OP_LESS_LOCAL_CONST_JUMP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void profileInstruction(uint8_t instruction) {
+  opCounts[instruction]++;
+  if (lastOps[1] >= 0) {
+    pairCounts[lastOps[1]][instruction]++;
+    if (lastOps[0] >= 0) tripleCounts[lastOps[0]][lastOps[1]][instruction]++;
+  }
+
+  if (endsRun(instruction)) {
+    lastOps[0] = lastOps[1] = -1;
+  } else {
+    lastOps[0] = lastOps[1];
+    lastOps[1] = instruction;
+  }
+}
+
+/**
+ * Prints the most executed opcodes, pairs and triples, to help pick which
+ * sequences are worth a superinstruction.
+ */
+void VM::printOpcodeProfile() {
+  const int top = 15;
+  auto print = [&](const char* title, std::vector<std::pair<uint64_t, std::string>>& counts,
+                   uint64_t total) {
+    std::sort(counts.begin(), counts.end(), std::greater<>());
+    printf("%s\n", title);
+    for (int i = 0; i < top && i < (int)counts.size(); i++) {
+      printf("%12llu %5.1f%%  %s\n", (unsigned long long)counts[i].first,
+             100.0 * counts[i].first / total, counts[i].second.c_str());
+    }
+  };
+
+  uint64_t registerTotal = 0;
+  std::vector<std::pair<uint64_t, std::string>> registerOps;
+  for (int i = 0; i < REGISTER_OPCODE_COUNT; i++) {
+    registerTotal += registerOpCounts[i];
+    if (registerOpCounts[i] > 0) registerOps.push_back({registerOpCounts[i], registerOpcodeName(i)});
+  }
+  if (registerTotal > 0) {
+    printf("%llu register instructions\n", (unsigned long long)registerTotal);
+    print("opcodes:", registerOps, registerTotal);
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i < OPCODE_COUNT; i++) total += opCounts[i];
+  if (total == 0) return;
+
+  std::vector<std::pair<uint64_t, std::string>> singles, pairs, triples;
+  for (int a = 0; a < OPCODE_COUNT; a++) {
+    if (opCounts[a] > 0) singles.push_back({opCounts[a], opcodeName(a)});
+    for (int b = 0; b < OPCODE_COUNT; b++) {
+      if (pairCounts[a][b] > 0) {
+        pairs.push_back({pairCounts[a][b], std::string(opcodeName(a)) + " " + opcodeName(b)});
+      }
+      for (int c = 0; c < OPCODE_COUNT; c++) {
+        if (tripleCounts[a][b][c] == 0) continue;
+        triples.push_back({tripleCounts[a][b][c],
+                           std::string(opcodeName(a)) + " " + opcodeName(b) + " " + opcodeName(c)});
+      }
+    }
+  }
+
+  printf("%llu instructions\n", (unsigned long long)total);
+  print("opcodes:", singles, total);
+  print("pairs:", pairs, total);
+  print("triples:", triples, total);
 }
+#endif
 
 InterpretResult VM::run() {
-  CallFrame frame = frames[frameCount-1];
-#define READ_BYTE() (frame.ip++)
-#define READ_CONSTANT() (frame.closure->function->chunk.constants[READ_BYTE()])
-// TODO: no idea what this READ_SHORT is doing with the ip, it probably doesn't work. I tried to have it mask into a 16-bit int.
+  CallFrame* frame = &frames[frameCount-1];
+#define READ_BYTE() (*frame->ip++)
+#define READ_CONSTANT() (frame->closure->function->chunk.constants[READ_BYTE()])
 #define READ_SHORT() \
-  (frame.ip += 2, \
-  (uint16_t)((frame.closure->function->chunk.code[frame.ip-2] << 8) | frame.closure->function->chunk.code[frame.ip-1]))
+  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_CONSTANT_LONG() \
+  (frame->closure->function->chunk.constants[READ_SHORT()])
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
 #define BINARY_OP(valueType, op) \
   do { \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
       runtimeError("Operands must be numbers."); \
       return INTERPRET_RUNTIME_ERROR; \
     } \
-    double b = AS_NUMBER(stack.back());\
-    stack.pop_back();\
-    stack.back() = valueType(AS_NUMBER(stack.back()) op b);\
+    double b = AS_NUMBER(pop()); \
+    stackTop[-1] = valueType(AS_NUMBER(stackTop[-1]) op b); \
   } while (false)
 
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+  do { \
+    for (Value* slot = stack; slot < stackTop; slot++) { \
+      std::cout << "[ "; \
+      printValue(*slot); \
+      std::cout << " ]"; \
+    } \
+    std::cout << "\n"; \
+    frame->closure->function->chunk.disassembleInstruction( \
+        (int)(frame->ip - frame->closure->function->chunk.code.data())); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif
+
+#ifdef PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*frame->ip)
+#else
+#define PROFILE_INSTRUCTION() do {} while (false)
+#endif
+
+/**
+ * With COMPUTED_GOTO every handler ends by jumping straight to the handler of
+ * the next instruction through dispatchTable, so each opcode gets its own
+ * indirect branch that the branch predictor can learn separately. Otherwise
+ * we fall back to the plain switch, where every handler breaks back to the
+ * one shared jump at the top of the loop.
+ *
+ * The compiler always ends a function with OP_RETURN, so we never need to
+ * check if ip ran off the end of the code.
+ */
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    &&TARGET_OP_CONSTANT,
+    &&TARGET_OP_NIL,
+    &&TARGET_OP_TRUE,
+    &&TARGET_OP_FALSE,
+    &&TARGET_OP_POP,
+    &&TARGET_OP_GET_LOCAL,
+    &&TARGET_OP_SET_LOCAL,
+    &&TARGET_OP_DEFINE_GLOBAL,
+    &&TARGET_OP_GET_GLOBAL,
+    &&TARGET_OP_SET_GLOBAL,
+    &&TARGET_OP_GET_UPVALUE,
+    &&TARGET_OP_SET_UPVALUE,
+    &&TARGET_OP_EQUAL,
+    &&TARGET_OP_SET_PROPERTY,
+    &&TARGET_OP_GET_PROPERTY,
+    &&TARGET_OP_GET_SUPER,
+    &&TARGET_OP_GREATER,
+    &&TARGET_OP_LESS,
+    &&TARGET_OP_ADD,
+    &&TARGET_OP_SUBTRACT,
+    &&TARGET_OP_MULTIPLY,
+    &&TARGET_OP_DIVIDE,
+    &&TARGET_OP_NOT,
+    &&TARGET_OP_NEGATE,
+    &&TARGET_OP_PRINT,
+    &&TARGET_OP_JUMP,
+    &&TARGET_OP_JUMP_IF_FALSE,
+    &&TARGET_OP_LOOP,
+    &&TARGET_OP_CALL,
+    &&TARGET_OP_INVOKE,
+    &&TARGET_OP_SUPER_INVOKE,
+    &&TARGET_OP_CLOSURE,
+    &&TARGET_OP_CLOSE_UPVALUE,
+    &&TARGET_OP_RETURN,
+    &&TARGET_OP_CLASS,
+    &&TARGET_OP_INHERIT,
+    &&TARGET_OP_METHOD,
+    &&TARGET_OP_CONSTANT_LONG,
+    &&TARGET_OP_GET_GLOBAL_LONG,
+    &&TARGET_OP_GET_PROPERTY_LONG,
+    &&TARGET_OP_WIDE,
+    &&TARGET_OP_ADD_LOCAL_LOCAL,
+    &&TARGET_OP_LESS_LOCAL_CONST_JUMP,
+    &&TARGET_OP_INCREMENT_LOCAL,
+  };
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OPCODE_COUNT,
+                "dispatchTable must have one entry per OpCode, in order");
+
+#define DISPATCH() \
+  do { \
+    TRACE_INSTRUCTION(); \
+    PROFILE_INSTRUCTION(); \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (false)
+#define CASE(op) TARGET_##op
+#define NEXT() DISPATCH()
+#else
+#define CASE(op) case op
+#define NEXT() break
+#endif
+
   auto vm = VM::GetInstance();
-  frame.ip = 0;
-  while (frame.ip < frame.closure->function->chunk.code.size()) {
-    #ifdef DEBUG_TRACE_EXECUTION
-    for (Value value : stack) {
-      std::cout << "[ ";
-      printValue(value);
-      std::cout << " ]";
-    }
-    std::cout << "\n";
-    frame.closure->function->chunk.disassembleInstruction(frame.ip);
-    #endif
-    uint8_t instruction = frame.closure->function->chunk.code[frame.ip++];
+#ifdef COMPUTED_GOTO
+  DISPATCH();
+  {
+#else
+  for (;;) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
+    uint8_t instruction = READ_BYTE();
 
     switch (instruction) {
-      case OP_CONSTANT:
+#endif
+      CASE(OP_CONSTANT):
         {
           Value constant = READ_CONSTANT();
-          stack.push_back(constant);
-          break;
+          push(constant);
+          NEXT();
         }
-      case OP_NEGATE:
+      CASE(OP_NEGATE):
         if (!IS_NUMBER(peek(0))) {
           runtimeError("Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        {
-          auto backValue = stack.back();
-          stack.pop_back();
-          stack.push_back(NUMBER_VAL(-AS_NUMBER(backValue)));
-        }
-        break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        NEXT();
+      CASE(OP_ADD): {
+        if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
           BINARY_OP(NUMBER_VAL, +);
@@ -90,183 +372,192 @@ InterpretResult VM::run() {
           runtimeError("Operands must be two numbers or two strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
-      }      
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NIL:
-        stack.push_back(NIL_VAL);
-        break;        
-      case OP_TRUE:
-        stack.push_back(BOOL_VAL(true));
-        break;        
-      case OP_FALSE:
-        stack.push_back(BOOL_VAL(false));
-        break;
-      case OP_NOT: {
-        auto backValue = stack.back();
-        stack.pop_back();
-        stack.push_back(BOOL_VAL(isFalsey(backValue)));
-        break;
+        NEXT();
       }
-      case OP_POP: {
-        stack.pop_back(); 
-        break;
+      CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT();
+      CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT();
+      CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); NEXT();
+      CASE(OP_NIL):
+        push(NIL_VAL);
+        NEXT();
+      CASE(OP_TRUE):
+        push(BOOL_VAL(true));
+        NEXT();
+      CASE(OP_FALSE):
+        push(BOOL_VAL(false));
+        NEXT();
+      CASE(OP_NOT): {
+        push(BOOL_VAL(isFalsey(pop())));
+        NEXT();
+      }
+      CASE(OP_POP): {
+        pop(); 
+        NEXT();
       }
-      case OP_GET_LOCAL: {
+      CASE(OP_GET_LOCAL): {
         uint8_t slot = READ_BYTE();
-        stack.push_back(frame.slots[slot]);
-        break;
+        push(frame->slots[slot]);
+        NEXT();
       }
-      case OP_SET_LOCAL: {
+      CASE(OP_SET_LOCAL): {
         uint8_t slot = READ_BYTE();
-        frame.slots[slot] = peek(0);
-        break;
+        frame->slots[slot] = peek(0);
+        NEXT();
       }
-      case OP_GET_GLOBAL: {
+      CASE(OP_GET_GLOBAL): {
         ObjString* name = READ_STRING();
-        if (vm->globals.find(name) == vm->globals.end()) {
+        Value value;
+        if (!vm->globals.lookup(name, &value)) {
           runtimeError("Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        stack.push_back(vm->globals[name]);
-        break;
+        push(value);
+        NEXT();
       }
-      case OP_DEFINE_GLOBAL: {
+      CASE(OP_DEFINE_GLOBAL): {
         ObjString* name = READ_STRING();
-        vm->globals[name] = peek(0);
+        vm->globals.add(name, peek(0));
+        // The name could be young as well as the value
+        globalsRemembered = true;
+        pop();
+        NEXT();
       }
-      case OP_SET_GLOBAL: {
+      CASE(OP_SET_GLOBAL): {
         ObjString* name = READ_STRING();
-        if (vm->globals.find(name) == vm->globals.end()) {
+        if (!vm->globals.assign(name, peek(0))) {
           runtimeError("Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        globalBarrier(peek(0));
+        NEXT();
       }
-      case OP_GET_UPVALUE: {
+      CASE(OP_GET_UPVALUE): {
         uint8_t slot = READ_BYTE();
-        stack.push_back(frame.closure->upvalues[slot]->location[0]);
-        break;
+        push(*frame->closure->upvalues[slot]->location);
+        NEXT();
       }
-      case OP_SET_UPVALUE: {
+      CASE(OP_SET_UPVALUE): {
         uint8_t slot = READ_BYTE();
-        frame.closure->upvalues[slot]->location[0] = peek(0);
-        break;
+        ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+        snapshotBarrier(*upvalue->location);
+        *upvalue->location = peek(0);
+        writeBarrier((Obj*)upvalue, peek(0));
+        NEXT();
       }
-      case OP_GET_SUPER: {
+      CASE(OP_GET_SUPER): {
         ObjString* name = READ_STRING();
-        ObjClass* superclass = AS_CLASS(stack.back());
-        stack.pop_back();
+        ObjClass* superclass = AS_CLASS(peek(0));
+        pop();
 
         if (!bindMethod(superclass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        NEXT();
       }
-      case OP_EQUAL: {
-        Value b = stack.back();
-        stack.pop_back();
-        Value a = stack.back();
-        stack.pop_back();
-        stack.push_back(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      CASE(OP_EQUAL): {
+        // Comparing ropes can allocate, so leave both on the stack for now
+        bool equal = valuesEqual(peek(1), peek(0));
+        pop();
+        pop();
+        push(BOOL_VAL(equal));
+        NEXT();
       }
-      case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-      case OP_PRINT: {
-        printValue(stack.back());
-        stack.pop_back();
+      CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); NEXT();
+      CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); NEXT();
+      CASE(OP_PRINT): {
+        printValue(peek(0));
+        pop();
         printf("\n");
-        break;
+        NEXT();
       }
-      case OP_JUMP: {
+      CASE(OP_JUMP): {
         uint16_t offset = READ_SHORT();
-        frame.ip += offset;
-        break;
+        frame->ip += offset;
+        NEXT();
       }
-      case OP_JUMP_IF_FALSE: {
+      CASE(OP_JUMP_IF_FALSE): {
         uint16_t offset = READ_SHORT();
         if (isFalsey(peek(0))) {
-          frame.ip += offset;
+          frame->ip += offset;
         }
-        break;
+        NEXT();
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP): {
         uint16_t offset = READ_SHORT();
-        frame.ip -= offset;
-        break;
+        frame->ip -= offset;
+        SAFEPOINT();
+        NEXT();
       }
-      case OP_CALL: {
+      CASE(OP_CALL): {
         int argCount = READ_BYTE();
         if (!callValue(peek(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = frames[frameCount - 1];
-        break;
+        frame = &frames[frameCount - 1];
+        NEXT();
       }
-      case OP_INVOKE: {
+      CASE(OP_INVOKE): {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
+        if (!invoke(method, argCount, READ_CACHE())) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = frames[frameCount - 1];
-        break;
+        frame = &frames[frameCount - 1];
+        NEXT();
       }
-      case OP_SUPER_INVOKE: {
+      CASE(OP_SUPER_INVOKE): {
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
-        ObjClass* superclass = AS_CLASS(stack.back());
-        stack.pop_back();
+        ObjClass* superclass = AS_CLASS(peek(0));
+        pop();
         if (!invokeFromClass(superclass, method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = frames[frameCount - 1];
-        break;
+        frame = &frames[frameCount - 1];
+        NEXT();
       }
-      case OP_CLOSURE: {
+      CASE(OP_CLOSURE): {
         ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
         ObjClosure* closure = newClosure(function);
-        stack.push_back(OBJ_VAL(closure));
+        push(OBJ_VAL(closure));
         for (int i = 0; i < closure->upvalueCount; i++) {
           uint8_t isLocal = READ_BYTE();
           uint8_t index = READ_BYTE();
           if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(std::vector<Value>(frame.slots.begin() + index, frame.slots.end()));
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
           } else {
-            closure->upvalues[i] = frame.closure->upvalues[index];
+            closure->upvalues[i] = frame->closure->upvalues[index];
           }
         }
-        break;
+        NEXT();
       }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues();
-        stack.pop_back();
-        break;
-      case OP_RETURN:
+      CASE(OP_CLOSE_UPVALUE):
+        closeUpvalues(stackTop - 1);
+        pop();
+        NEXT();
+      CASE(OP_RETURN):
         {
-          Value result = stack.back();
-          stack.pop_back();
-          closeUpvalues();
+          Value result = pop();
+          closeUpvalues(frame->slots);
           frameCount--;
           if (frameCount == 0) {
-            stack.pop_back();
+            pop();
             return INTERPRET_OK;
           }
 
-          stack = frame.slots;
-          stack.push_back(result);
-          frame = frames[frameCount-1];
-          break;
+          // Discard the callee's whole window in one go
+          stackTop = frame->slots;
+          push(result);
+          frame = &frames[frameCount-1];
+          SAFEPOINT();
+          NEXT();
         }
-      case OP_CLASS: {
-        stack.push_back(OBJ_VAL(newClass(READ_STRING())));
-        break;
+      CASE(OP_CLASS): {
+        push(OBJ_VAL(newClass(READ_STRING())));
+        NEXT();
       }
-      case OP_GET_PROPERTY: {
+      CASE(OP_GET_PROPERTY): {
         if (!IS_INSTANCE(peek(0))) {
           runtimeError("Only instances have properties.");
           return INTERPRET_RUNTIME_ERROR;
@@ -274,113 +565,690 @@ InterpretResult VM::run() {
 
         ObjInstance* instance = AS_INSTANCE(peek(0));
         ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
 
-        if (instance->fields.find(name) != instance->fields.end()) {
-          stack.pop_back(); // instance
-          stack.push_back(instance->fields[name]);
-          break;
+        CacheEntry* cached = findCacheEntry(cache, instance->shape);
+        if (cached != NULL) {
+          CACHE_HIT(cache);
+          if (cached->slot >= 0) {
+            stackTop[-1] = *fieldSlot(instance, cached->slot);
+          } else {
+            ObjBoundMethod* bound = newBoundMethod(peek(0), cached->method);
+            stackTop[-1] = OBJ_VAL(bound);
+          }
+          NEXT();
+        }
+
+        CACHE_MISS(cache);
+        ObjShape* shape = instance->shape;
+        int slot = shapeSlot(shape, name);
+        if (slot >= 0) {
+          updateCache(cache, shape, slot, NULL);
+          stackTop[-1] = *fieldSlot(instance, slot);
+          NEXT();
         }
 
         if (!bindMethod(instance->klass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        updateCache(cache, shape, -1, AS_BOUND_METHOD(peek(0))->method);
+        NEXT();
       }
-      case OP_SET_PROPERTY: {
+      CASE(OP_SET_PROPERTY): {
         if (!IS_INSTANCE(peek(1))) {
           runtimeError("Only instances have properties.");
           return INTERPRET_RUNTIME_ERROR;
         }
 
         ObjInstance* instance = AS_INSTANCE(peek(1));
-        instance->fields[READ_STRING()] = peek(0);
-        Value value = stack.back();
-        stack.pop_back();
-        stack.pop_back();
-        stack.push_back(value);
-        break;
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+
+        CacheEntry* cached = findCacheEntry(cache, instance->shape);
+        if (cached != NULL && cached->transition == NULL) {
+          CACHE_HIT(cache);
+          snapshotBarrier(*fieldSlot(instance, cached->slot));
+          *fieldSlot(instance, cached->slot) = peek(0);
+          writeBarrier((Obj*)instance, peek(0));
+        } else if (cached != NULL) {
+          CACHE_HIT(cache);
+          addField(instance, cached->transition, peek(0));
+        } else {
+          CACHE_MISS(cache);
+          ObjShape* shape = instance->shape;
+          int slot = shapeSlot(shape, name);
+          if (slot >= 0) {
+            snapshotBarrier(*fieldSlot(instance, slot));
+            *fieldSlot(instance, slot) = peek(0);
+            writeBarrier((Obj*)instance, peek(0));
+            updateCache(cache, shape, slot, NULL);
+          } else {
+            ObjShape* transition = shapeTransition(shape, name);
+            addField(instance, transition, peek(0));
+            updateCache(cache, shape, transition->fieldCount - 1, NULL, transition);
+          }
+        }
+
+        Value value = pop();
+        stackTop[-1] = value;
+        NEXT();
       }
-      case OP_INHERIT: {
+      CASE(OP_INHERIT): {
         Value superclass = peek(1);
         if (!IS_CLASS(superclass)) {
           runtimeError("Superclass must be a class");
           return INTERPRET_RUNTIME_ERROR;
         }
         ObjClass* subclass = AS_CLASS(peek(0));
-        auto superclassMethods = AS_CLASS(superclass)->methods;
-        for (auto it = superclassMethods.begin(); it != superclassMethods.end(); ++it) {
-          subclass->methods[it->first] = it->second;
-        }
-        stack.pop_back(); // pop off the subclass
-        break;
+        inheritMethods(subclass, AS_CLASS(superclass));
+        pop(); // pop off the subclass
+        NEXT();
       }
-      case OP_METHOD:
+      CASE(OP_METHOD):
         defineMethod(READ_STRING());
-        break;
+        NEXT();
+      // The long and widened forms only turn up in chunks with more than 256
+      // constants or locals. They get handlers of their own rather than
+      // jumping into the short forms' ones, since every extra entry point
+      // into a handler costs the hot loop a few percent. Property access on
+      // this path skips the inline cache.
+      CASE(OP_CONSTANT_LONG):
+        push(READ_CONSTANT_LONG());
+        NEXT();
+      CASE(OP_GET_GLOBAL_LONG): {
+        ObjString* name = READ_STRING_LONG();
+        Value value;
+        if (!vm->globals.lookup(name, &value)) {
+          runtimeError("Undefined variable '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        push(value);
+        NEXT();
+      }
+      CASE(OP_GET_PROPERTY_LONG): {
+        ObjString* name = READ_STRING_LONG();
+        frame->ip += 2; // the unused cache index
+        if (!getProperty(name)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        NEXT();
+      }
+      CASE(OP_WIDE): {
+        uint8_t widened = READ_BYTE();
+        uint16_t operand = READ_SHORT();
+#define OPERAND_STRING() \
+  AS_STRING(frame->closure->function->chunk.constants[operand])
+        switch (widened) {
+          case OP_GET_LOCAL:
+            push(frame->slots[operand]);
+            break;
+          case OP_SET_LOCAL:
+            frame->slots[operand] = peek(0);
+            break;
+          case OP_DEFINE_GLOBAL:
+            vm->globals.add(OPERAND_STRING(), peek(0));
+            globalsRemembered = true;
+            pop();
+            break;
+          case OP_SET_GLOBAL:
+            if (!vm->globals.assign(OPERAND_STRING(), peek(0))) {
+              runtimeError("Undefined variable '%s'.", OPERAND_STRING()->chars);
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            globalBarrier(peek(0));
+            break;
+          case OP_SET_PROPERTY:
+            frame->ip += 2; // the unused cache index
+            if (!setProperty(OPERAND_STRING())) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+          case OP_GET_SUPER:
+            if (!bindMethod(AS_CLASS(pop()), OPERAND_STRING())) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+          case OP_INVOKE: {
+            int argCount = READ_BYTE();
+            if (!invoke(OPERAND_STRING(), argCount, READ_CACHE())) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &frames[frameCount - 1];
+            break;
+          }
+          case OP_SUPER_INVOKE: {
+            int argCount = READ_BYTE();
+            if (!invokeFromClass(AS_CLASS(pop()), OPERAND_STRING(), argCount)) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &frames[frameCount - 1];
+            break;
+          }
+          case OP_CLASS:
+            push(OBJ_VAL(newClass(OPERAND_STRING())));
+            break;
+          case OP_METHOD:
+            defineMethod(OPERAND_STRING());
+            break;
+          // The upvalue indexes are 2 bytes too
+          case OP_CLOSURE: {
+            ObjFunction* function =
+                AS_FUNCTION(frame->closure->function->chunk.constants[operand]);
+            ObjClosure* closure = newClosure(function);
+            push(OBJ_VAL(closure));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+              uint8_t isLocal = READ_BYTE();
+              uint16_t index = READ_SHORT();
+              if (isLocal) {
+                closure->upvalues[i] = captureUpvalue(frame->slots + index);
+              } else {
+                closure->upvalues[i] = frame->closure->upvalues[index];
+              }
+            }
+            break;
+          }
+          default:
+            runtimeError("Unknown instruction after OP_WIDE.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+#undef OPERAND_STRING
+        NEXT();
+      }
+      // The instructions a superinstruction stands for are still there after
+      // it (see fuseSuperinstructions()), and ip is pointing at the operand
+      // of the first one. The fast path skips to the end of the run. If the
+      // operands aren't numbers, we push the local like the OP_GET_LOCAL we
+      // replaced and carry on with the next original instruction.
+      CASE(OP_ADD_LOCAL_LOCAL): {
+        Value a = frame->slots[frame->ip[0]];
+        Value b = frame->slots[frame->ip[2]];
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+          frame->ip += 4;
+        } else {
+          push(a);
+          frame->ip += 1;
+        }
+        NEXT();
+      }
+      CASE(OP_LESS_LOCAL_CONST_JUMP): {
+        Value a = frame->slots[frame->ip[0]];
+        if (IS_NUMBER(a)) {
+          double limit = AS_NUMBER(frame->closure->function->chunk.constants[frame->ip[2]]);
+          if (AS_NUMBER(a) < limit) {
+            frame->ip += 8;
+          } else {
+            // Past the OP_POP at the jump target as well
+            frame->ip += 8 + ((frame->ip[5] << 8) | frame->ip[6]);
+          }
+        } else {
+          push(a);
+          frame->ip += 1;
+        }
+        NEXT();
+      }
+      CASE(OP_INCREMENT_LOCAL): {
+        Value* local = &frame->slots[frame->ip[0]];
+        if (IS_NUMBER(*local)) {
+          double step = AS_NUMBER(frame->closure->function->chunk.constants[frame->ip[2]]);
+          *local = NUMBER_VAL(AS_NUMBER(*local) + step);
+          frame->ip += 7;
+        } else {
+          push(*local);
+          frame->ip += 1;
+        }
+        NEXT();
+      }
+#ifndef COMPUTED_GOTO
       default:
         runtimeError("Unimplemented instruction in VM run()");
         return INTERPRET_RUNTIME_ERROR;
     }
+#endif
   }
+#undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
 #undef READ_SHORT
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
 #undef BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+#undef NEXT
   runtimeError("Unreachable code at the end of VM run()");
   return INTERPRET_RUNTIME_ERROR;
 }
 
-InterpretResult VM::interpret(std::string& source) {
+/**
+ * The register machine's version of run(), for code from RegisterGenerator
+ * in compiler.cpp. A frame's registers are the same window of the value stack
+ * the stack machine would use for it, and stackTop stays at the end of that
+ * window so the GC sees every register.
+ */
+InterpretResult VM::runRegisters() {
+  CallFrame* frame;
+  Value* registers;
+  Value* constants;
+#define LOAD_FRAME() \
+  do { \
+    frame = &frames[frameCount - 1]; \
+    registers = frame->slots; \
+    constants = frame->closure->function->registerChunk.constants.data(); \
+  } while (false)
+#define READ_BYTE() (*frame->ip++)
+#define READ_SHORT() \
+  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_STRING() AS_STRING(constants[READ_BYTE()])
+#define OPERAND(index, mode, constantBit) \
+  (((mode) & (constantBit)) ? constants[index] : registers[index])
+// Reads the a (and b) operands and the mode byte after them into a (and b)
+#define READ_OPERAND(a) \
+  Value a = OPERAND(frame->ip[0], frame->ip[1], MODE_A_CONSTANT); \
+  frame->ip += 2
+#define READ_OPERANDS(a, b) \
+  Value a = OPERAND(frame->ip[0], frame->ip[2], MODE_A_CONSTANT); \
+  Value b = OPERAND(frame->ip[1], frame->ip[2], MODE_B_CONSTANT); \
+  frame->ip += 3
+#define BINARY_OP(valueType, op) \
+  do { \
+    uint8_t dst = READ_BYTE(); \
+    READ_OPERANDS(a, b); \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+      runtimeError("Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    registers[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+  } while (false)
+// Jumps unless a op b
+#define COMPARE_JUMP(op) \
+  do { \
+    READ_OPERANDS(a, b); \
+    uint16_t offset = READ_SHORT(); \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+      runtimeError("Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    if (!(AS_NUMBER(a) op AS_NUMBER(b))) frame->ip += offset; \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+  do { \
+    for (Value* slot = frame->slots; slot < stackTop; slot++) { \
+      std::cout << "[ "; \
+      printValue(*slot); \
+      std::cout << " ]"; \
+    } \
+    std::cout << "\n"; \
+    frame->closure->function->registerChunk.disassembleRegisterInstruction( \
+        (int)(frame->ip - frame->closure->function->registerChunk.code.data())); \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif
+
+#ifdef PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() (registerOpCounts[*frame->ip]++)
+#else
+#define PROFILE_INSTRUCTION() do {} while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    &&TARGET_ROP_LOAD_CONSTANT,
+    &&TARGET_ROP_LOAD_NIL,
+    &&TARGET_ROP_LOAD_TRUE,
+    &&TARGET_ROP_LOAD_FALSE,
+    &&TARGET_ROP_MOVE,
+    &&TARGET_ROP_GET_GLOBAL,
+    &&TARGET_ROP_DEFINE_GLOBAL,
+    &&TARGET_ROP_SET_GLOBAL,
+    &&TARGET_ROP_EQUAL,
+    &&TARGET_ROP_GREATER,
+    &&TARGET_ROP_LESS,
+    &&TARGET_ROP_ADD,
+    &&TARGET_ROP_SUBTRACT,
+    &&TARGET_ROP_MULTIPLY,
+    &&TARGET_ROP_DIVIDE,
+    &&TARGET_ROP_NOT,
+    &&TARGET_ROP_NEGATE,
+    &&TARGET_ROP_PRINT,
+    &&TARGET_ROP_JUMP,
+    &&TARGET_ROP_JUMP_IF_FALSE,
+    &&TARGET_ROP_LOOP,
+    &&TARGET_ROP_GREATER_JUMP,
+    &&TARGET_ROP_LESS_JUMP,
+    &&TARGET_ROP_CALL,
+    &&TARGET_ROP_CLOSURE,
+    &&TARGET_ROP_RETURN,
+  };
+  static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == REGISTER_OPCODE_COUNT,
+                "dispatchTable must have one entry per RegisterOpCode, in order");
+
+#define DISPATCH() \
+  do { \
+    TRACE_INSTRUCTION(); \
+    PROFILE_INSTRUCTION(); \
+    goto *dispatchTable[READ_BYTE()]; \
+  } while (false)
+#define CASE(op) TARGET_##op
+#define NEXT() DISPATCH()
+#else
+#define CASE(op) case op
+#define NEXT() break
+#endif
+
+  LOAD_FRAME();
+#ifdef COMPUTED_GOTO
+  DISPATCH();
+  {
+#else
+  for (;;) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
+    switch (READ_BYTE()) {
+#endif
+      CASE(ROP_LOAD_CONSTANT): {
+        uint8_t dst = READ_BYTE();
+        registers[dst] = constants[READ_BYTE()];
+        NEXT();
+      }
+      CASE(ROP_LOAD_NIL):
+        registers[READ_BYTE()] = NIL_VAL;
+        NEXT();
+      CASE(ROP_LOAD_TRUE):
+        registers[READ_BYTE()] = BOOL_VAL(true);
+        NEXT();
+      CASE(ROP_LOAD_FALSE):
+        registers[READ_BYTE()] = BOOL_VAL(false);
+        NEXT();
+      CASE(ROP_MOVE): {
+        uint8_t dst = READ_BYTE();
+        registers[dst] = registers[READ_BYTE()];
+        NEXT();
+      }
+      CASE(ROP_GET_GLOBAL): {
+        uint8_t dst = READ_BYTE();
+        ObjString* name = READ_STRING();
+        if (!globals.lookup(name, &registers[dst])) {
+          runtimeError("Undefined variable '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        NEXT();
+      }
+      CASE(ROP_DEFINE_GLOBAL): {
+        ObjString* name = READ_STRING();
+        READ_OPERAND(value);
+        globals.add(name, value);
+        globalsRemembered = true;
+        NEXT();
+      }
+      CASE(ROP_SET_GLOBAL): {
+        ObjString* name = READ_STRING();
+        READ_OPERAND(value);
+        if (!globals.assign(name, value)) {
+          runtimeError("Undefined variable '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        globalBarrier(value);
+        NEXT();
+      }
+      CASE(ROP_EQUAL): {
+        // Both operands are still in registers or constants if comparing
+        // ropes allocates
+        uint8_t dst = READ_BYTE();
+        READ_OPERANDS(a, b);
+        registers[dst] = BOOL_VAL(valuesEqual(a, b));
+        NEXT();
+      }
+      CASE(ROP_GREATER):  BINARY_OP(BOOL_VAL, >); NEXT();
+      CASE(ROP_LESS):     BINARY_OP(BOOL_VAL, <); NEXT();
+      CASE(ROP_ADD): {
+        uint8_t dst = READ_BYTE();
+        READ_OPERANDS(a, b);
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          registers[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        } else if (IS_TEXT(a) && IS_TEXT(b)) {
+          // concatenate() works on the stack, which has room past the
+          // registers (see callRegisters())
+          push(a);
+          push(b);
+          concatenate();
+          registers[dst] = pop();
+        } else {
+          runtimeError("Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        NEXT();
+      }
+      CASE(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT();
+      CASE(ROP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT();
+      CASE(ROP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); NEXT();
+      CASE(ROP_NOT): {
+        uint8_t dst = READ_BYTE();
+        READ_OPERAND(a);
+        registers[dst] = BOOL_VAL(isFalsey(a));
+        NEXT();
+      }
+      CASE(ROP_NEGATE): {
+        uint8_t dst = READ_BYTE();
+        READ_OPERAND(a);
+        if (!IS_NUMBER(a)) {
+          runtimeError("Operand must be a number.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        registers[dst] = NUMBER_VAL(-AS_NUMBER(a));
+        NEXT();
+      }
+      CASE(ROP_PRINT): {
+        READ_OPERAND(a);
+        printValue(a);
+        printf("\n");
+        NEXT();
+      }
+      CASE(ROP_JUMP): {
+        uint16_t offset = READ_SHORT();
+        frame->ip += offset;
+        NEXT();
+      }
+      CASE(ROP_JUMP_IF_FALSE): {
+        uint8_t condition = READ_BYTE();
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(registers[condition])) frame->ip += offset;
+        NEXT();
+      }
+      CASE(ROP_LOOP): {
+        uint16_t offset = READ_SHORT();
+        frame->ip -= offset;
+        SAFEPOINT();
+        NEXT();
+      }
+      CASE(ROP_GREATER_JUMP): COMPARE_JUMP(>); NEXT();
+      CASE(ROP_LESS_JUMP):    COMPARE_JUMP(<); NEXT();
+      CASE(ROP_CALL): {
+        uint8_t base = READ_BYTE();
+        int argCount = READ_BYTE();
+        if (!callRegisterValue(&registers[base], argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        NEXT();
+      }
+      CASE(ROP_CLOSURE): {
+        uint8_t dst = READ_BYTE();
+        ObjFunction* function = AS_FUNCTION(constants[READ_BYTE()]);
+        registers[dst] = OBJ_VAL(newClosure(function));
+        NEXT();
+      }
+      CASE(ROP_RETURN): {
+        READ_OPERAND(result);
+        frameCount--;
+        if (frameCount == 0) {
+          stackTop = stack;
+          return INTERPRET_OK;
+        }
+
+        // The callee's slot is the caller's register for the result
+        *frame->slots = result;
+        LOAD_FRAME();
+        stackTop = frame->slots + frame->closure->function->maxStackDepth;
+        SAFEPOINT();
+        NEXT();
+      }
+#ifndef COMPUTED_GOTO
+      default:
+        runtimeError("Unimplemented instruction in VM runRegisters()");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+#endif
+  }
+#undef LOAD_FRAME
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_STRING
+#undef OPERAND
+#undef READ_OPERAND
+#undef READ_OPERANDS
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+  runtimeError("Unreachable code at the end of VM runRegisters()");
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+InterpretResult VM::interpret(std::string_view source) {
   Chunk chunk;
   ObjFunction* function = compile(source, chunk);
 
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
+  return interpret(function);
+}
 
-  stack.push_back(OBJ_VAL(function));
+// Runs a script that's already compiled, by compile() or from a .loxc file
+InterpretResult VM::interpret(ObjFunction* function) {
+  push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
-  stack.pop_back();
-  stack.push_back(OBJ_VAL(closure));
-  call(closure, 0);
+  pop();
+  push(OBJ_VAL(closure));
+#ifdef TIME_STARTUP
+  reportStartup();
+#endif
+  if (useRegisters) {
+    if (!function->registerChunk.code.empty()) {
+      if (!callRegisters(closure, stackTop - 1, 0)) return INTERPRET_RUNTIME_ERROR;
+      return runRegisters();
+    }
+    fprintf(stderr, "Script needs the stack machine, ignoring --registers.\n");
+  }
+  if (!call(closure, 0)) return INTERPRET_RUNTIME_ERROR;
 
   return run();
 }
 
-Value VM::peek(int distance) {
-  return stack[stack.size() - 1 - distance];
-}
-
 bool VM::call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but god %d.", closure->function->arity, argCount);
+    runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+    return false;
   }
 
-  if (frameCount == FRAMES_MAX) {
+  // This is the only overflow check for the value stack. The compiler worked
+  // out the deepest this function's frame can get, so if that fits now,
+  // nothing pushed by the callee can run off the end.
+  Value* slots = stackTop - argCount - 1;
+  if (frameCount == FRAMES_MAX ||
+      slots + closure->function->maxStackDepth + STACK_TEMPS > stack + STACK_MAX) {
     runtimeError("Stack overflow");
     return false;
   }
 
-  CallFrame frame = frames[frameCount++];
+  CallFrame& frame = frames[frameCount++];
   frame.closure = closure;
-  frame.ip = 0;
-  frame.slots = std::vector<Value>(stack.end() - argCount - 1, stack.end());
+  frame.ip = closure->function->chunk.code.data();
+  frame.slots = slots;
   return true;
 }
 
+/**
+ * call() for the register machine. The caller already put the callee and
+ * arguments in slots, the rest of the callee's registers start out nil so the
+ * GC never sees garbage in them.
+ */
+bool VM::callRegisters(ObjClosure* closure, Value* slots, int argCount) {
+  ObjFunction* function = closure->function;
+  if (function->registerChunk.code.empty()) {
+    runtimeError("%s() can't run on the register machine.",
+                 function->name != NULL ? function->name->chars : "script");
+    return false;
+  }
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+    return false;
+  }
+
+  // Two extra slots for concatenate(), which still uses the stack
+  if (frameCount == FRAMES_MAX ||
+      slots + function->maxStackDepth + 2 + STACK_TEMPS > stack + STACK_MAX) {
+    runtimeError("Stack overflow");
+    return false;
+  }
+
+  CallFrame& frame = frames[frameCount++];
+  frame.closure = closure;
+  frame.ip = function->registerChunk.code.data();
+  frame.slots = slots;
+  for (Value* slot = slots + argCount + 1; slot < slots + function->maxStackDepth; slot++) {
+    *slot = NIL_VAL;
+  }
+  stackTop = slots + function->maxStackDepth;
+  return true;
+}
+
+/**
+ * callValue() for the register machine, with the callee at base and the
+ * arguments after it. The register code has no classes, so only closures and
+ * natives can be called.
+ */
+bool VM::callRegisterValue(Value* base, int argCount) {
+  Value callee = *base;
+  if (IS_OBJ(callee)) {
+    switch (OBJ_TYPE(callee)) {
+      case OBJ_CLOSURE:
+        return callRegisters(AS_CLOSURE(callee), base, argCount);
+      case OBJ_NATIVE:
+        *base = AS_NATIVE(callee)(argCount, base + 1);
+        return true;
+      default:
+        break;
+    }
+  }
+  runtimeError("Can only call functions on the register machine.");
+  return false;
+}
+
 bool VM::callValue(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_BOUND_METHOD: {
         ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-        stack[stack.size() - 1 - argCount] = bound->receiver;
+        stackTop[-argCount - 1] = bound->receiver;
         return call(bound->method, argCount);
       }
       case OBJ_CLASS: {
         ObjClass* klass = AS_CLASS(callee);
-        stack[stack.size() - 1 - argCount] = OBJ_VAL(newInstance(klass));
-        if (klass->methods.find(initString) != klass->methods.end()) {
-          return call(AS_CLOSURE(klass->methods[initString]), argCount);
+        stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+        ObjClosure* initializer = findMethod(klass, initString);
+        if (initializer != NULL) {
+          return call(initializer, argCount);
         } else if (argCount != 0) {
           runtimeError("Expected 0 arguments for a class without an init(), but got %d.", argCount);
         }
@@ -390,10 +1258,9 @@ bool VM::callValue(Value callee, int argCount) {
         return call(AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        std::vector<Value> newSlots = std::vector<Value>(stack.end() - argCount, stack.end());
-        Value result = native(argCount, newSlots);
-        stack = std::vector<Value>(stack.begin(), stack.end() - argCount - 1);
-        stack.push_back(result);
+        Value result = native(argCount, stackTop - argCount);
+        stackTop -= argCount + 1;
+        push(result);
         return true;
       }
       default:
@@ -405,13 +1272,15 @@ bool VM::callValue(Value callee, int argCount) {
 }
 
 bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
-  if (klass->methods.find(name) == klass->methods.end()) {
+  ObjClosure* method = findMethod(klass, name);
+  if (method == NULL) {
     runtimeError("Undefined property '%s'.", name->chars);
+    return false;
   }
-  return call(AS_CLOSURE(klass->methods[name]), argCount);
+  return call(method, argCount);
 }
 
-bool VM::invoke(ObjString* name, int argCount) {
+bool VM::invoke(ObjString* name, int argCount, InlineCache* cache) {
   Value receiver = peek(argCount);
     
   if (!IS_INSTANCE(receiver)) {
@@ -421,42 +1290,66 @@ bool VM::invoke(ObjString* name, int argCount) {
 
   ObjInstance* instance = AS_INSTANCE(receiver);
 
-  // Handle cases where class.field() is calling the function stored in the
-  // field and not a class method called field
-  if (instance->fields.find(name) != instance->fields.end()) {
-    stack[stack.size() - argCount - 1] = instance->fields[name];
-    return callValue(instance->fields[name], argCount);
+  // A field holding a function shadows a method with the same name, and the
+  // shape says which one this is, so both end up cached by shape
+  int slot;
+  CacheEntry* cached = findCacheEntry(cache, instance->shape);
+  if (cached != NULL) {
+    CACHE_HIT(cache);
+    if (cached->slot < 0) return call(cached->method, argCount);
+    slot = cached->slot;
+  } else {
+    CACHE_MISS(cache);
+    slot = shapeSlot(instance->shape, name);
+    if (slot < 0) {
+      ObjClosure* method = findMethod(instance->klass, name);
+      if (method == NULL) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+      }
+      updateCache(cache, instance->shape, -1, method);
+      return call(method, argCount);
+    }
+    updateCache(cache, instance->shape, slot, NULL);
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  Value value = *fieldSlot(instance, slot);
+  stackTop[-argCount - 1] = value;
+  return callValue(value, argCount);
 }
 
 bool VM::bindMethod(ObjClass* klass, ObjString* name) {
-  if (klass->methods.find(name) == klass->methods.end()) {
+  ObjClosure* method = findMethod(klass, name);
+  if (method == NULL) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
 
-  ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(klass->methods[name]));
+  ObjBoundMethod* bound = newBoundMethod(peek(0), method);
 
-  stack.pop_back();
-  stack.push_back(OBJ_VAL(bound));
+  pop();
+  push(OBJ_VAL(bound));
   return true;
 }
 
-ObjUpvalue* VM::captureUpvalue(std::vector<Value> local) {
+/**
+ * openUpvalues is sorted by stack slot, highest first, so we can stop looking
+ * as soon as we pass the slot we want.
+ */
+ObjUpvalue* VM::captureUpvalue(Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
   ObjUpvalue* upvalue = openUpvalues;
-  while (upvalue != NULL && &upvalue->location[0] > &local[0]) {
+  while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
   }
 
-  if (upvalue != NULL && &upvalue->location[0] == &local[0]) {
+  if (upvalue != NULL && upvalue->location == local) {
     return upvalue;
   }
 
   ObjUpvalue* createdUpvalue = newUpvalue(local);
+  createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
     openUpvalues = createdUpvalue;
@@ -468,29 +1361,78 @@ ObjUpvalue* VM::captureUpvalue(std::vector<Value> local) {
 }
 
 /**
- * TODO: Almost certain this is incorrect too. I really should've just used
- * pointers, but really dead now.
+ * Closes every open upvalue pointing at last or above it on the stack. The
+ * value gets moved into the upvalue itself and location is pointed at it, so
+ * closures keep working after the stack slot is gone.
  */
-void VM::closeUpvalues() {
-  while (openUpvalues != NULL && &openUpvalues->location[0] >= &stack.back()) {
+void VM::closeUpvalues(Value* last) {
+  while (openUpvalues != NULL && openUpvalues->location >= last) {
     ObjUpvalue* upvalue = openUpvalues;
-    upvalue->closed = upvalue->location[0];
-    /** TODO: I don't understand this code, in the book they do 
-     * upvalue->closed = *upvalue->location;
-     * upvalue->location = &upvalue->closed;
-     * 
-     * Isn't that leaving the location the exactly value as before?
-     */
-    // upvalue->location = &upvalue->closed;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
     openUpvalues = upvalue->next;
   }
 }
 
+/**
+ * Method names get selectors, numbered from 0, the first time any class
+ * defines a method with that name. selectors keeps those strings alive so a
+ * name can't be collected and re-interned without its selector.
+ */
+int VM::selectorOf(ObjString* name) {
+  if (name->selector < 0) {
+    name->selector = (int)selectors.size();
+    selectors.push_back(name);
+  }
+  return name->selector;
+}
+
+/**
+ * What OP_GET_PROPERTY and OP_SET_PROPERTY do on a cache miss, for their long
+ * forms, which don't use the cache. The operands are on the stack where the
+ * short forms expect them.
+ */
+bool VM::getProperty(ObjString* name) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(0));
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    stackTop[-1] = *fieldSlot(instance, slot);
+    return true;
+  }
+  return bindMethod(instance->klass, name);
+}
+
+bool VM::setProperty(ObjString* name) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(1));
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    snapshotBarrier(*fieldSlot(instance, slot));
+    *fieldSlot(instance, slot) = peek(0);
+    writeBarrier((Obj*)instance, peek(0));
+  } else {
+    addField(instance, shapeTransition(instance->shape, name), peek(0));
+  }
+
+  Value value = pop();
+  stackTop[-1] = value;
+  return true;
+}
+
 void VM::defineMethod(ObjString* name) {
-  Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
-  klass->methods[name] = method;
-  stack.pop_back();
+  defineClassMethod(klass, selectorOf(name), AS_CLOSURE(peek(0)));
+  pop();
 }
 
 void VM::runtimeError(const char* format, ...) {
@@ -500,33 +1442,48 @@ void VM::runtimeError(const char* format, ...) {
   va_end(args);
   std::fputs("\n", stderr);
 
-  CallFrame frame = frames[frameCount - 1];
-  // Since our ip is relative to the chunk, I think we can just leave it as just ip
-  auto instruction = frame.ip;
-  auto line = frame.closure->function->chunk.getLines()[instruction];
-  std::fprintf(stderr, "[line %d] in script\n", line);
-
   for (int i = frameCount - 1; i >= 0; i--) {
-    CallFrame frame = frames[i];
-    ObjFunction* function = frame.closure->function;
-    auto instruction = frame.ip;
-    fprintf(stderr, "[line %d] in ", function->chunk.getLines()[instruction]);
+    CallFrame* frame = &frames[i];
+    ObjFunction* function = frame->closure->function;
+    Chunk& chunk = isRegisterFrame(frame) ? function->registerChunk : function->chunk;
+    // ip has already moved past the instruction that failed
+    size_t instruction = frame->ip - chunk.code.data() - 1;
+    fprintf(stderr, "[line %d] in ", chunk.getLine(instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
-  
-  // TODO: I only added this here because I don't have resetStack() in my code
+
+  resetStack();
+}
+
+// Drops every frame and value, e.g. after a runtime error unwinds the script
+void VM::resetStack() {
+  stackTop = stack;
   frameCount = 0;
-  // resetStack();
+  openUpvalues = NULL;
 }
 
 void VM::defineNative(const char* name, NativeFn function) {
-  stack.push_back(OBJ_VAL(copyString(name, (int)strlen(name))));
-  stack.push_back(OBJ_VAL(newNative(function)));
-  globals[AS_STRING(stack[0])] = stack[1];
-  stack.pop_back();
-  stack.pop_back();
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  push(OBJ_VAL(newNative(function)));
+  globals.add(AS_STRING(peek(1)), peek(0));
+  globalsRemembered = true;
+  pop();
+  pop();
+}
+
+/**
+ * Prints the hit rate of every inline cache that got used, in every function
+ * that's still alive. Only does anything when built with -DINLINE_CACHE_STATS.
+ */
+void VM::printCacheStats() {
+  forEachOldObject([](Obj* object) {
+    if (object->type != OBJ_FUNCTION) return;
+
+    ObjFunction* function = (ObjFunction*)object;
+    function->chunk.printCacheStats(function->name != NULL ? function->name->chars : "<script>");
+  });
 }
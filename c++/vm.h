@@ -4,11 +4,16 @@
 #include "object.h"
 #include "chunk.h"
 #include "memory.h"
+#include "table.h"
+#include <cstdlib>
 #include <vector>
 #include <map>
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Room past a frame's maxStackDepth for values the runtime pushes to keep
+// them reachable while it allocates, like a new shape or string
+#define STACK_TEMPS 1
 
 typedef enum
 {
@@ -18,29 +23,30 @@ typedef enum
 } InterpretResult;
 
 /**
- * We differ slightly from the book implementation here, where we have a
- * separate instruction pointer and code array. The book just uses the ip as a
- * pointer inside the code array, which I found to be weird, as it overloads
- * the definition of a pointer to be index and accessor.
+ * A CallFrame is just a window into the VM's value stack. ip points at the
+ * next byte to execute in the closure's chunk and slots points at the stack
+ * slot holding the callee, with the arguments and locals right after it.
+ *
+ * I originally had ip as an index and slots as its own std::vector copied off
+ * the stack, but that meant every call and return was copying the stack
+ * around. The stack is a fixed array of STACK_MAX values that never moves, so
+ * pointers into it stay valid for the lifetime of the VM.
  */
 typedef struct {
   ObjClosure* closure;
-  size_t ip;
-  std::vector<uint8_t> code;
-  /**
-   * Slots contains the local variable values. This can change depending on the
-   * call stack, e.g. if we go into a function, our slots will shift to the end
-   * of the slots from before. Hence why it's called "slots" since we only see
-   * a slot of all value at any given time.
-   */
-  std::vector<Value> slots;
+  uint8_t* ip;
+  Value* slots;
 } CallFrame;
 
 class VM
 {
 private:
   InterpretResult run();
+  InterpretResult runRegisters();
+  bool callRegisters(ObjClosure* closure, Value* slots, int argCount);
+  bool callRegisterValue(Value* base, int argCount);
   void concatenate();
+  void resetStack();
 
   /**
    * The Singleton's constructor should always be private to prevent direct
@@ -48,10 +54,30 @@ private:
    */
   VM()
   {
+    resetStack();
     bytesAllocated = 0;
     nextGC = 1024 * 1024;
-    initString = NULL; // prevent GC from trying to collect on initString
-    initString = copyString("init", 4);
+    gcGrowFactor = 2;
+    gcMinInterval = 1024 * 1024;
+    gcStats = {};
+    gcPhase = GC_IDLE;
+    initSizeClasses(sizeClasses);
+    largePages = NULL;
+    unsweptLarge = NULL;
+    unsweptPages = 0;
+    emptyPages = NULL;
+    emptyPageCount = 0;
+    gcStepWork = 1024;
+    gcMaxPause = 1000;
+    nurseryStart = (uint8_t*)malloc(NURSERY_SIZE);
+    nurseryTop = nurseryStart;
+    nurseryEnd = nurseryStart + NURSERY_SIZE;
+    nurseryFull = false;
+    globalsRemembered = false;
+    // prevent GC from trying to collect on initString. The actual string gets
+    // made in GetInstance(), since copyString() needs the instance to exist.
+    initString = NULL;
+    useRegisters = false;
   }
 
   static VM *vm_;
@@ -60,30 +86,156 @@ public:
   // For garbage collection
   CallFrame frames[FRAMES_MAX];
   int frameCount;
-  std::vector<Value> stack;
-  Obj *objects;
+  Value stack[STACK_MAX];
+  Value* stackTop;
   ObjUpvalue *openUpvalues;
   std::vector<Obj*> grayStack;
   size_t bytesAllocated;
+  // A major collection starts once bytesAllocated passes nextGC. After each
+  // one, nextGC is gcGrowFactor times what's left, but at least gcMinInterval
+  // bytes more. Set by --gc-heap (the first nextGC), --gc-growth and
+  // --gc-min.
   size_t nextGC;
+  double gcGrowFactor;
+  size_t gcMinInterval;
+  GCStats gcStats;
+
+  // The major collection in progress, see collectStep()
+  GCPhase gcPhase;
+  // The old space, see heap.h. Large objects each have a page of their own.
+  SizeClass sizeClasses[SIZE_CLASS_COUNT];
+  Page* largePages;
+  Page* unsweptLarge;
+  // How many pages are left to sweep, counting both kinds
+  size_t unsweptPages;
+  // Pages that got swept empty, for any size class to reuse
+  Page* emptyPages;
+  size_t emptyPageCount;
+  // How many objects each increment traces or sweeps, 0 for all of them at
+  // once, and how many microseconds it may take. Set by --gc-step and
+  // --gc-pause.
+  size_t gcStepWork;
+  double gcMaxPause;
 
-  // String interning
-  std::map<uint32_t, ObjString*> strings;
-  std::map<ObjString*, Value> globals;
+  // The young generation, see allocateYoung() and collectNursery()
+  uint8_t* nurseryStart;
+  uint8_t* nurseryTop;
+  uint8_t* nurseryEnd;
+  // Set when an allocation didn't fit, so the next safepoint collects
+  bool nurseryFull;
+  // Old objects that may point into the nursery, see writeBarrier()
+  std::vector<Obj*> rememberedSet;
+  // Like rememberedSet for globals, which is a root
+  bool globalsRemembered;
+  // Young objects that own memory outside the nursery, see ownsMemory()
+  std::vector<Obj*> youngOwners;
+  // Old copies made by the minor collection in progress, still to be scanned
+  std::vector<Obj*> promotedStack;
+
+  // String interning. Every string is in here as a key (with a nil value),
+  // so equal strings are always the same object. The GC treats it as weak.
+  HashTable strings;
+  HashTable globals;
   ObjString* initString;
+  // Method names by selector, see selectorOf()
+  std::vector<ObjString*> selectors;
+  // Set by --registers. The compiler then also generates register code, and
+  // interpret() runs it with runRegisters() when the whole script has some.
+  bool useRegisters;
+
+  InterpretResult interpret(std::string_view source);
+  InterpretResult interpret(ObjFunction* function);
+
+  /**
+   * These are on the hot path of every instruction, so they live in the
+   * header to get inlined. Nothing here checks for overflow, call() makes
+   * sure there's enough room for the whole frame before we enter it.
+   */
+  void push(Value value) {
+    *stackTop = value;
+    stackTop++;
+  }
+
+  Value pop() {
+    stackTop--;
+    return *stackTop;
+  }
+
+  Value peek(int distance) {
+    return stackTop[-1 - distance];
+  }
+
+  bool isYoung(Obj* object) {
+    return (uintptr_t)object - (uintptr_t)nurseryStart < NURSERY_SIZE;
+  }
+
+  // Young objects keep their mark in the header, old ones in their page
+  bool isMarked(Obj* object) {
+    if (isYoung(object)) return object->isMarked;
+    return testBit(pageOf(object)->marks, granuleOf(object));
+  }
+
+  void setMarked(Obj* object) {
+    if (isYoung(object)) {
+      object->isMarked = true;
+    } else {
+      setBit(pageOf(object)->marks, granuleOf(object));
+    }
+  }
+
+  /**
+   * Has to be called after storing value into holder, unless holder was
+   * allocated since the last safepoint. A minor collection only looks at old
+   * objects in the remembered set, so an old object pointing at a young one
+   * that isn't in there would be left pointing at a stale copy.
+   */
+  void writeBarrier(Obj* holder, Obj* value) {
+    if (!holder->isRemembered && isYoung(value) && !isYoung(holder)) {
+      rememberObject(holder);
+    }
+  }
+
+  void writeBarrier(Obj* holder, Value value) {
+    if (IS_OBJ(value)) writeBarrier(holder, AS_OBJ(value));
+  }
+
+  /**
+   * Has to be called with the reference in a heap object that's about to be
+   * overwritten, before it is (a Yuasa deletion barrier). While a major
+   * collection is marking, it only keeps what was reachable when it started,
+   * so anything that might only have been reachable through this reference
+   * gets marked now. Roots don't need it, they all got marked at the start.
+   */
+  void snapshotBarrier(Obj* old) {
+    if (gcPhase == GC_MARK && old != NULL && !isMarked(old)) markObject(old);
+  }
+
+  void snapshotBarrier(Value old) {
+    if (IS_OBJ(old)) snapshotBarrier(AS_OBJ(old));
+  }
+
+  // The write barrier for storing value in globals
+  void globalBarrier(Value value) {
+    if (IS_OBJ(value) && isYoung(AS_OBJ(value))) globalsRemembered = true;
+  }
 
-  InterpretResult interpret(std::string &source);
-  Value peek(int distance);
   bool callValue(Value callee, int argCount);
   bool call(ObjClosure* function, int argCount);
   void runtimeError(const char *format, ...);
   void defineNative(const char* name, NativeFn function);
-  ObjUpvalue* captureUpvalue(std::vector<Value> local);
-  void closeUpvalues();
+  ObjUpvalue* captureUpvalue(Value* local);
+  void closeUpvalues(Value* last);
+  int selectorOf(ObjString* name);
   void defineMethod(ObjString* name);
   bool bindMethod(ObjClass* klass, ObjString* name);
-  bool invoke(ObjString* name, int argCount);
+  bool getProperty(ObjString* name);
+  bool setProperty(ObjString* name);
+  bool invoke(ObjString* name, int argCount, InlineCache* cache);
   bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
+  void printCacheStats();
+#ifdef PROFILE_OPCODES
+  void printOpcodeProfile();
+#endif
   
   /**
    * Singletons should not be cloneable.
@@ -105,6 +257,7 @@ public:
   {
     initString = NULL; // Allow the interned string to get collected
     freeObjects();
+    free(nurseryStart);
   }
 };
 